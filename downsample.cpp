@@ -29,606 +29,5631 @@
 #include <unordered_map>
 #include <mutex>
 #include <chrono>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DOWNSAMPLE_X86_KERNELS 1
+#endif
 
 
 using namespace std;
 using namespace std::chrono;
 
-//Set the max threads that the program can create, to perform downsampling
-//Best value is the number of cores in the machine 
-#define MAX_THREADS 4
+//startThreading keeps splitting the image into quadrants until there are this many tiles per worker thread, 
+//so that idle workers always find a tile to steal.
+#define TILES_PER_THREAD 4
+
+//Rows and cols of the cells of a level that twoDArray::getRegion() computes and remembers together
+#define LAZY_TILE 32
+
+//reduceGlobalMap splits a level into row bands run on the pool when it has at least this many cells per band
+#define REDUCE_BAND_CELLS 4096
 
 typedef boost::multi_array< unsigned int, 2> baseImage;
 typedef baseImage::index index;
 baseImage::extent_gen extents;
 
 
-std::mutex mapMutexThread1;
-std::mutex mapMutexThread2;
-std::mutex mapMutexThread3;
-std::mutex mapMutexThread4;
+
+//Set to 0 to compile the instrumentation probes out altogether
+#ifndef DOWNSAMPLE_INSTRUMENTATION
+#define DOWNSAMPLE_INSTRUMENTATION 1
+#endif
+
+//A complete ("X") Chrome trace event. start and duration are in microseconds, args holds the members of the JSON args object.
+struct traceEvent
+{
+    const char * name;
+    int64_t start, duration;
+    std::string args;
+};
 
 /*----------------------------------------------------------
 * DESCRIPTION
 * 
-* This class manages the information about a 2x2 block of data. 
-* 
-* member variables m_mode and m_count store the mode value and its count .
+* Counters and trace events recorded by one thread while instrumentation is switched on. 
 *
-* For example, for the 2x2 block shown below,
-*[  1,  1]
-*[  1,  2]
-* m_mode = 1
-* m_count = 3
+* thread - number of the thread in the order threads first recorded something
+* blocks - 2x2 blocks read by findRowModes() and the strip tasks of stripDownsampler
+* histogramAllocations - times the sparse part of a blockHistogram had to grow its storage
+* uniformCells - cells set straight from a uniform block or from a group of uniform cells of the same value, without merging histograms
+* lockWaits - times a queue lock of the workStealingPool was held by another thread and had to be waited for
+* idleWaits - times a worker went to sleep because there was no task to run or steal
+* bytesCopied - bytes copied by copies of modeMap objects and of the base image
+* events - trace events of tiles, strips and levels
+* ---------------------------------------------------------------
+*/
+struct threadCounters
+{
+    int thread;
+    uint64_t blocks, histogramAllocations, uniformCells, lockWaits, idleWaits, bytesCopied;
+    std::vector<traceEvent> events;
+
+    explicit threadCounters(int number): thread(number), blocks(0), histogramAllocations(0), uniformCells(0), lockWaits(0), idleWaits(0), bytesCopied(0)
+    {
+    }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Runtime switch and registry for the instrumentation of the hot paths. 
+* 
+* Every thread records into its own threadCounters, found through t_counters, so probes never share a cache line or take a lock. 
+* The counters are owned by s_threads and outlive the threads, so they can be written out once a pool is gone.
+* While instrumentation is off a probe costs one relaxed atomic load and a branch. 
+* With DOWNSAMPLE_INSTRUMENTATION set to 0 enabled() is constant false and the probes are removed by the compiler.
 *
-* m_depth indicates how many recursive calls to startThreading happened befoe the object was createad.
+* writeTrace() dumps every event in the Chrome trace event format (chrome://tracing or ui.perfetto.dev), 
+* one row per thread, followed by a counter event per thread with its totals.
 * ---------------------------------------------------------------
 */
-class modeMap
+class instrumentation
 {
-	private:
-		std::map< unsigned int, unsigned int> cube;
-		unsigned int m_mode;
-		unsigned int m_count;
-		int m_threadNumber;
-		int m_depth;
+    private:
+        static std::atomic<bool> s_enabled;
+        static std::mutex s_registryLock;
+        static std::vector< std::unique_ptr<threadCounters> > s_threads;
+        static const steady_clock::time_point s_epoch;
+        static thread_local threadCounters * t_counters;
 
-     
-	public:
-    /**
-        Constructor
-        */
-		modeMap(): m_mode(0), m_count(0)  
-		{
-		}
-		
-        size_t getMapSize() { return cube.size(); }
-		unsigned int getMode() { return m_mode; }
+    public:
+        //Switches recording on or off. Counters recorded so far are kept.
+        static void enable(bool on) { s_enabled.store(on, std::memory_order_relaxed); }
+
+        static bool enabled()
+        {
+#if DOWNSAMPLE_INSTRUMENTATION
+            return s_enabled.load(std::memory_order_relaxed);
+#else
+            return false;
+#endif
+        }
 
-		unsigned int getCount(){ return m_count; }
+        //Counters of the calling thread, registered the first time the thread asks for them
+        static threadCounters & local()
+        {
+            if(!t_counters)
+            {
+                std::lock_guard<std::mutex> guard(s_registryLock);
+                s_threads.push_back(std::unique_ptr<threadCounters>(new threadCounters(static_cast<int>(s_threads.size()))));
+                t_counters = s_threads.back().get();
+            }
+            return *t_counters;
+        }
 
-         /**
+        //Adds amount to one counter of the calling thread, if instrumentation is on
+        static void add(uint64_t threadCounters::* counter, uint64_t amount = 1)
+        {
+            if(enabled()) local().*counter += amount;
+        }
+
+        //Microseconds since the program started
+        static int64_t now()
+        {
+            return duration_cast<microseconds>(steady_clock::now() - s_epoch).count();
+        }
+
+        /**
         
-        Add's a new element to the map if it isn't present already.
-        Increases the value by one to count for the element in the 2x2 block.
+        Locks a mutex, counting a lock wait when it is already held by another thread. 
         
-        @param data - element to be added the map
-        @return void      
+        @param mutex - the mutex to lock
+        @return the lock      
        */
-		void addElement(unsigned int data, int count = 1)
-		{	
-			cube[data]  += count;
-            return;
-		}
+        static std::unique_lock<std::mutex> lock(std::mutex & mutex)
+        {
+            std::unique_lock<std::mutex> guard(mutex, std::try_to_lock);
+            if(!guard.owns_lock())
+            {
+                add(&threadCounters::lockWaits);
+                guard.lock();
+            }
+            return guard;
+        }
+
+        //Clears the counters and events of every thread. Must not be called while other threads are recording.
+        static void reset()
+        {
+            std::lock_guard<std::mutex> guard(s_registryLock);
+            for(auto counters = s_threads.begin(); counters != s_threads.end(); ++counters)
+            {
+                int thread = (*counters)->thread;
+                **counters = threadCounters(thread);
+            }
+        }
 
-        
         /**
         
-        Function to calcuate the mode and count of the 2x2 block. 
-        This function is called after the cube data member has been populated 
-        
-        @param void
-        @return void   
+        Writes every recorded event and the counters of every thread as a Chrome trace event JSON document. 
+        Must not be called while other threads are recording.
         
+        @param out - stream receiving the document
+        @return void      
+       */
+        static void writeTrace(std::ostream & out)
+        {
+            std::lock_guard<std::mutex> guard(s_registryLock);
+            int64_t end = now();
+            bool first = true;
+
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+            for(auto counters = s_threads.begin(); counters != s_threads.end(); ++counters)
+            {
+                const threadCounters & thread = **counters;
+
+                out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.thread 
+                    << ", \"args\": {\"name\": \"thread " << thread.thread << "\"}}";
+                first = false;
+
+                for(auto event = thread.events.begin(); event != thread.events.end(); ++event)
+                {
+                    out << ",\n{\"name\": \"" << event->name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread.thread 
+                        << ", \"ts\": " << event->start << ", \"dur\": " << event->duration << ", \"args\": {" << event->args << "}}";
+                }
+
+                out << ",\n{\"name\": \"thread " << thread.thread << " counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": " << thread.thread 
+                    << ", \"ts\": " << end << ", \"args\": {\"blocks\": " << thread.blocks << ", \"histogramAllocations\": " << thread.histogramAllocations 
+                    << ", \"uniformCells\": " << thread.uniformCells << ", \"lockWaits\": " << thread.lockWaits << ", \"idleWaits\": " << thread.idleWaits << ", \"bytesCopied\": " << thread.bytesCopied << "}}";
+            }
+            out << "\n]}" << std::endl;
+        }
+};
+
+std::atomic<bool> instrumentation::s_enabled(false);
+std::mutex instrumentation::s_registryLock;
+std::vector< std::unique_ptr<threadCounters> > instrumentation::s_threads;
+const steady_clock::time_point instrumentation::s_epoch = steady_clock::now();
+thread_local threadCounters * instrumentation::t_counters = nullptr;
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Records a trace event covering its own lifetime on the calling thread, if instrumentation was on when it was created. 
+* Up to two integer arguments are attached to the event, they are only formatted when the event is recorded.
+* ---------------------------------------------------------------
+*/
+class traceScope
+{
+    private:
+        const char * m_name;
+        const char * m_keys[2];
+        long long m_values[2];
+        int64_t m_start;
+        bool m_active;
+
+    public:
+    /**
+        Constructor
         */
-        
-		void calculateMode()
-		{		
-			for(auto element = cube.begin(); element != cube.end(); ++element)
-			{	
-				if(element->second > m_count) 
-				{	
-					m_mode = element->first;
-					m_count = element->second;
-				}
-			}
-		}
+        explicit traceScope(const char * name, const char * key1 = nullptr, long long value1 = 0, const char * key2 = nullptr, long long value2 = 0)
+            : m_name(name), m_start(0), m_active(instrumentation::enabled())
+        {
+            m_keys[0] = key1;
+            m_keys[1] = key2;
+            m_values[0] = value1;
+            m_values[1] = value2;
+            if(m_active) m_start = instrumentation::now();
+        }
 
-        
-        // Setter function to set the depth of the cube in the base image
-		void setDepth(int depth) { m_depth = depth; }
-	
-        // Setter function to set the threadNumber by which the cube was read by
-		void setthreadNumber(int threadNumber) { m_threadNumber = threadNumber; }
+        traceScope(const traceScope &) = delete;
+        traceScope & operator=(const traceScope &) = delete;
 
-        //Overloaded operator used to merge modeMap objects while downsampling.
-        friend modeMap operator+ (modeMap input1, modeMap input2)
+        ~traceScope()
         {
-            map< unsigned int, unsigned int> inMap1 = input1.getCube();
-            
-            for(auto iter = inMap1.begin(); iter != inMap1.end(); ++iter)
+            if(!m_active) return;
+
+            traceEvent event;
+            event.name = m_name;
+            event.start = m_start;
+            event.duration = instrumentation::now() - m_start;
+            for(int i = 0; i < 2 && m_keys[i]; ++i)
             {
-                input2.addElement(iter->first,iter->second);
+                event.args += (i ? ", \"" : "\"") + std::string(m_keys[i]) + "\": " + std::to_string(m_values[i]);
             }
-            
-            return input2;
-        
+            instrumentation::local().events.push_back(std::move(event));
         }
-        
-        //Getter function required for downsampling. 
-        map< unsigned int, unsigned int> & getCube()
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* The NUMA nodes of the machine and the cpus of each, read from /sys/devices/system/node. 
+* A machine without that directory is treated as a single node holding every cpu.
+* ---------------------------------------------------------------
+*/
+class numaTopology
+{
+    private:
+        std::vector< std::vector<int> > m_nodeCpus;
+
+        //Numbers of a sysfs list such as "0-3,8-11"
+        static std::vector<int> parseList(const std::string & list)
         {
-            return cube;
+            std::vector<int> numbers;
+            std::istringstream stream(list);
+            for(std::string range; std::getline(stream, range, ',');)
+            {
+                int first = 0, last = 0;
+                char dash = 0;
+                std::istringstream bounds(range);
+                if(!(bounds >> first)) continue;
+                last = (bounds >> dash >> last && dash == '-') ? last : first;
+                for(int number = first; number <= last; ++number) numbers.push_back(number);
+            }
+            return numbers;
         }
-        
-		~modeMap()
-		{
-		}
 
-}; 
+        //Contents of a small sysfs file, empty when it can't be read
+        static std::string readFile(const std::string & path)
+        {
+            std::ifstream file(path.c_str());
+            std::string contents;
+            std::getline(file, contents);
+            return contents;
+        }
+
+    public:
+    /**
+        Constructor, reads the topology of the running machine
+        */
+        numaTopology()
+        {
+            for(int node : parseList(readFile("/sys/devices/system/node/online")))
+            {
+                std::vector<int> cpus = parseList(readFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+                if(!cpus.empty()) m_nodeCpus.push_back(cpus);
+            }
+
+            if(m_nodeCpus.empty())
+            {
+                m_nodeCpus.resize(1);
+                for(unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) m_nodeCpus[0].push_back(static_cast<int>(cpu));
+            }
+        }
+
+        int getNodeCount() const { return static_cast<int>(m_nodeCpus.size()); }
+
+        const std::vector<int> & getCpus(int node) const { return m_nodeCpus[node]; }
+};
 
 
 /*----------------------------------------------------------
 * DESCRIPTION
 * 
-* This class manages the information for an entire 2D Array of data. 
+* A persistent pool of worker threads that share work by stealing. 
 * 
-* Member variables are described as below.
+* Every worker owns a queue of tasks. A worker pops the newest task from the back of its own queue, 
+* and when that is empty it steals the oldest task from the front of another worker's queue.
+* Tasks submitted from a worker go to its own queue, tasks submitted from any other thread are spread round robin.
 *
-* dimA - Number of Rows
-* dimB - Number of Cols
-* minDim - min (dimA, dimB)
-* m_numCols - number of Cols of 2X2 blocks 
-* m_depth -  the number of recursive calls to startThreading happened befoe the object was createad.
-* m_mapCollectThread1,m_mapCollectThread1,m_mapCollectThread1,m_mapCollectThread4 - A map of modeMap objects in a sub matrix of the baseImage. From startThreading function, a minimum of 4 threads will be created and each,
-                                                                                                                                          one these maps store the mode information for each small 2x2 block within that submatrix. The key for each modeMap in these maps is the location of the 2X2 blocks in the entire baseImage.
-* m_globalMap - Once all the above maps hav been created, they are stored together in one map for the enitre baseImage
-* m_baseImage is a 2 dimensional boost Multi Array
+* m_queued - number of tasks sitting in all the queues, sleeping workers are woken when it becomes non zero
+* t_workerIndex - index of the worker running on the current thread, -1 on threads outside the pool
+* m_workerNode, m_workerCpus - for a pool built with a numaTopology, the node of every worker and the cpus it is pinned to. Empty otherwise.
+*
+* Workers of a pinned pool are spread over the nodes in order, worker i on node i*nodes/threads. workerForRow() maps a band of rows 
+* to a worker the same way, so rows first touched by a task sent to that worker live on the node of the worker that later reads them. 
+* Pinned workers steal from workers of their own node before the others.
+*
+* The threads are created once in the constructor, so running a task never creates a thread.
+* ---------------------------------------------------------------
+*/
+class workStealingPool
+{
+    private:
+        struct workerQueue
+        {
+            std::mutex lock;
+            std::deque< std::function<void()> > tasks;
+        };
 
-For Example,
+        std::vector< std::unique_ptr<workerQueue> > m_queues;
+        std::vector<std::thread> m_workers;
+        std::mutex m_sleepLock;
+        std::condition_variable m_wakeUp;
+        std::atomic<int> m_queued;
+        std::atomic<unsigned int> m_nextQueue;
+        bool m_stop;
+        std::vector<int> m_workerNode;
+        std::vector< std::vector<int> > m_workerCpus;
 
-Given a baseImage of size, 8x8 the image is divided into 4 threads and each threads creates 4 more untill the total number of threads created reaches the max number defined above.
+        static thread_local int t_workerIndex;
 
-3 4 0 6 | 6 4 3 1
-1 4 4 4 | 0 1 4 0
-6 1 4 3 | 7 0 4 3
-4 5 2 2 | 1 4 7 4
---------------------
-7 5 8 4 | 1 2 4 0
-4 8 4 4 | 1 7 3 7
-8 7 8 4 | 7 3 8 2
-6 8 2 7 | 1 1 1 8
+        //Pins the calling worker to the cpus of its node, leaving it unpinned when none of them is available to the process
+        void pinWorker(int workerIndex)
+        {
+            cpu_set_t allowed, cpus;
+            CPU_ZERO(&cpus);
+            if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
 
-m_mapCollectThread1(2,3,4) save data about each 2x2 block in the baseImage and is grouped based on which thread read that 2x2 block.
-If max threads = 4, then each m_mapCollectThread1(2,3,4) would have 4 maps each with m_mode, m_count.
-The m_globalMap would later have all the 16 maps corresponding to the 16 2x2 blocks in the base image. The index for each 2X2 block is calculated as named in the following convention 
+            bool any = false;
+            for(int cpu : m_workerCpus[workerIndex])
+            {
+                if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                {
+                    CPU_SET(cpu, &cpus);
+                    any = true;
+                }
+            }
+            if(any) pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
 
-01 02 | 03 04
-05 06 | 07 08
------------------
-09 10 | 11 12
-13 14 | 15 16
+        //True when a pinned worker should steal from victim before the workers of other nodes
+        bool sameNode(int own, int victim) const
+        {
+            return m_workerNode.empty() || own < 0 || m_workerNode[own] == m_workerNode[victim];
+        }
 
-Once we have the data for a 2x2 block, we can further derive the downsampled image by grouping these 2x2 blocks together. 
- 
-* ---------------------------------------------------------------
-*/
+        //Loop run by every worker thread until the pool is destroyed.
+        void workerLoop(int workerIndex)
+        {
+            t_workerIndex = workerIndex;
+            if(!m_workerCpus.empty()) pinWorker(workerIndex);
 
-class twoDArray
-{
-        private:
-            int m_dimA, m_dimB, m_minDim, m_depth;
-            
-            int m_downRows, m_downCols;
-            
-            map < int, modeMap > m_mapCollectThread1;
-            map < int, modeMap > m_mapCollectThread2;
-            map < int, modeMap > m_mapCollectThread3;
-            map < int, modeMap > m_mapCollectThread4;
-            map < int, modeMap > m_globalMap;
-            
-            baseImage m_baseImage;
-            
-            public:
-            
-            /**
-            
-            Constructor for the class. Initializes all member variables and also fills the matrix with random values from 1-8.           
-              
-            */
-            twoDArray(int dimA, int dimB) : m_dimA(dimA), m_dimB(dimB), m_minDim((m_dimA > m_dimB) ? m_dimB : m_dimA), m_depth(0), m_baseImage(boost::extents[m_dimA][m_dimB]), m_downRows(dimA/2), m_downCols(dimB/2)
+            while(true)
+            {
+                if(runOneTask()) continue;
+
+                std::unique_lock<std::mutex> guard(m_sleepLock);
+                if(!m_stop && m_queued.load() == 0) instrumentation::add(&threadCounters::idleWaits);
+                m_wakeUp.wait(guard, [this]() { return m_stop || m_queued.load() > 0; });
+                if(m_stop && m_queued.load() == 0) return;
+            }
+        }
+
+    public:
+    /**
+        Constructor. 
+        
+        @param threads - number of worker threads, 0 uses std::thread::hardware_concurrency()
+               topology - nodes the workers are spread over and pinned to, or null to leave them to the scheduler
+        */
+        explicit workStealingPool(unsigned int threads = 0, const numaTopology * topology = nullptr): m_queued(0), m_nextQueue(0), m_stop(false)
+        {
+            if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
 
+            for(unsigned int i = 0; topology && i < threads; ++i)
             {
-                while(m_minDim != 1)
-                {	
-                    m_minDim /= 2;
-                    ++m_depth;
-                } 
+                int node = static_cast<int>(static_cast<size_t>(i) * topology->getNodeCount() / threads);
+                m_workerNode.push_back(node);
+                m_workerCpus.push_back(topology->getCpus(node));
+            }
 
-                for(index i = 0; i < m_dimA; ++i)
-                {
-                    for(index j = 0; j < m_dimB; ++j)
-                    {
-                        m_baseImage[i][j] = rand()%9;
-                        
-                        //uncommment the below TWO statements to see the original matrix
-                        //std::cout << m_baseImage[i][j] << " ";
-                    }
-                    //std::cout << std::endl;
-                }
-                
-                //Restore min Dimension. We will need this when we are printing downsampled versions
-                m_minDim  = (m_dimA > m_dimB) ? m_dimB : m_dimA;
-                //m_minDim /= 2;
+            for(unsigned int i = 0; i < threads; ++i) m_queues.push_back(std::unique_ptr<workerQueue>(new workerQueue));
+            for(unsigned int i = 0; i < threads; ++i) m_workers.push_back(std::thread(&workStealingPool::workerLoop, this, static_cast<int>(i)));
+        }
+
+        workStealingPool(const workStealingPool &) = delete;
+        workStealingPool & operator=(const workStealingPool &) = delete;
+
+        unsigned int getThreadCount() const { return static_cast<unsigned int>(m_workers.size()); }
+
+        //True when the workers are pinned to the nodes of a numaTopology
+        bool isPinned() const { return !m_workerNode.empty(); }
+
+        //True when runOneTask() can run tasks on the calling thread, which threads outside a pinned pool can't
+        bool canRunTasks() const { return t_workerIndex >= 0 || m_workerNode.empty(); }
+
+        //Worker that handles row of an image or level with rows rows in a pinned pool, -1 when the pool isn't pinned
+        int workerForRow(int row, int rows) const
+        {
+            if(m_workerNode.empty() || rows <= 0) return -1;
+            return static_cast<int>(std::min<long long>(m_workerNode.size() - 1, static_cast<long long>(row) * m_workerNode.size() / rows));
+        }
+
+        /**
+        
+        Queues a task for the pool. 
+        
+        @param task - callable to run on one of the workers
+               worker - queue the task goes to, -1 for the queue of the calling worker or the next one round robin. 
+                        Another worker can still steal it.
+        @return void      
+       */
+        void submit(std::function<void()> task, int worker = -1)
+        {
+            int target = (worker >= 0) ? worker : t_workerIndex;
+            if(target < 0 || target >= static_cast<int>(m_queues.size())) target = m_nextQueue++ % m_queues.size();
+
+            {
+                std::unique_lock<std::mutex> guard = instrumentation::lock(m_queues[target]->lock);
+                m_queues[target]->tasks.push_back(std::move(task));
             }
-            
-            /**
-            
-            Function to create a modeMap object for every 2x2 block. The function add's all the four elements first and then calls the caluclateMode(), setDepth and setThreadNumber function.             
-             
-             @param 
-                    rowStart, rowEnd - row positions of the elements in the baseImage 
-                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
-                    depth - Depth of the cube in the baseImage 
-                    threadNumber - thread reading a particular 2x2 block in the baseImage.
 
-             @return 
-                    modeMap object with all the elements, mode and count data.            
-            */
-            
-            
-            modeMap findMode(int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber)
             {
+                std::lock_guard<std::mutex> guard(m_sleepLock);
+                ++m_queued;
+            }
+            m_wakeUp.notify_one();
+        }
+
+        /**
+        
+        Runs one queued task on the calling thread, if one can be found. 
+        Workers start with their own queue, every other queue is a candidate for stealing.
+        Threads outside a pinned pool run nothing, so the tasks sent to a worker stay on its node.
+        
+        @param void
+        @return true if a task was run      
+       */
+        bool runOneTask()
+        {
+            int count = static_cast<int>(m_queues.size());
+            int own = t_workerIndex;
+            std::function<void()> task;
+            if(own < 0 && !m_workerNode.empty()) return false;
+
+            if(own >= 0 && own < count)
+            {
+                std::unique_lock<std::mutex> guard = instrumentation::lock(m_queues[own]->lock);
+                if(!m_queues[own]->tasks.empty())
+                {
+                    task = std::move(m_queues[own]->tasks.back());
+                    m_queues[own]->tasks.pop_back();
+                }
+            }
+
+            for(int i = 1; !task && i <= 2 * count; ++i)
+            {
+                int victim = ((own < 0 ? 0 : own) + i) % count;
+                if(sameNode(own, victim) != (i <= count)) continue;
+                std::unique_lock<std::mutex> guard = instrumentation::lock(m_queues[victim]->lock);
+                if(!m_queues[victim]->tasks.empty())
+                {
+                    task = std::move(m_queues[victim]->tasks.front());
+                    m_queues[victim]->tasks.pop_front();
+                }
+            }
+
+            if(!task) return false;
+
+            --m_queued;
+            task();
+            return true;
+        }
+
+        ~workStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_sleepLock);
+                m_stop = true;
+            }
+            m_wakeUp.notify_all();
+
+            for(auto worker = m_workers.begin(); worker != m_workers.end(); ++worker) worker->join();
+        }
+};
+
+thread_local int workStealingPool::t_workerIndex = -1;
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* A set of tasks run on a workStealingPool that can be waited for together. 
+* 
+* Tasks may add more tasks to the same group while they run. wait() returns once every one of them has finished, 
+* and the waiting thread runs queued tasks itself in the meantime instead of blocking a core. 
+* A thread that can't run tasks, the main thread of a pinned pool, sleeps until the last task wakes it instead of taking a cpu from the workers.
+* The first exception thrown by a task is kept and rethrown by wait(), the destructor only waits.
+* ---------------------------------------------------------------
+*/
+class taskGroup
+{
+    private:
+        workStealingPool & m_pool;
+        std::atomic<int> m_pending;
+        std::mutex m_errorLock;
+        std::exception_ptr m_error;
+        std::mutex m_doneLock;
+        std::condition_variable m_done;
+
+        //Run queued tasks, or sleep when the calling thread can't, until every task of the group has finished
+        void drain()
+        {
+            if(!m_pool.canRunTasks())
+            {
+                std::unique_lock<std::mutex> guard(m_doneLock);
+                m_done.wait(guard, [this]() { return m_pending.load() == 0; });
+                return;
+            }
+
+            while(m_pending.load() > 0)
+            {
+                if(!m_pool.runOneTask()) std::this_thread::yield();
+            }
+
+            //The last task may still hold the lock, the group can only be destroyed once it has let go
+            std::lock_guard<std::mutex> guard(m_doneLock);
+        }
+
+    public:
+    /**
+        Constructor
+        */
+        explicit taskGroup(workStealingPool & pool): m_pool(pool), m_pending(0)
+        {
+        }
+
+        workStealingPool & getPool() { return m_pool; }
+
+        //Queue a task that belongs to this group, on the queue of worker when it isn't -1, see workStealingPool::submit()
+        void run(std::function<void()> task, int worker = -1)
+        {
+            ++m_pending;
+            m_pool.submit([this, task]()
+            {
+                try
+                {
+                    task();
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> guard(m_errorLock);
+                    if(!m_error) m_error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> guard(m_doneLock);
+                if(--m_pending == 0) m_done.notify_all();
+            }, worker);
+        }
+
+        //Wait for every task of the group, helping the pool while doing so. Rethrows the first exception of a task.
+        void wait()
+        {
+            drain();
+
+            std::exception_ptr error;
+            std::swap(error, m_error);
+            if(error) std::rethrow_exception(error);
+        }
+
+        ~taskGroup()
+        {
+            drain();
+        }
+};
+
+//Values below this bound are counted in a fixed size array inside every histogram. 
+//The generator in the twoDArray constructor only produces 0-8, so the default keeps every count on the stack.
+#define DENSE_DOMAIN 16
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* This class stores the element counts of a block of data without allocating a tree node per distinct value. 
+* Pixel is the element type of the image and Count the type the occurences are counted in, it has to hold the size of the largest block. 
+* The images and volumes built on it check this with checkCountFits().
+* 
+* Values smaller than DENSE_DOMAIN are counted directly in m_dense. 
+* Larger values fall back to m_sparse, a small vector of (value, count) pairs that is kept sorted by value.
+* m_distinct is the number of distinct values held in both parts together.
+*
+* For example, for the 2x2 block shown below,
+*[  1,  1]
+*[  1, 20]
+* m_dense[1] = 3
+* m_sparse = { (20, 1) }
+* m_distinct = 2
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class blockHistogram
+{
+    private:
+        Count m_dense[DENSE_DOMAIN];
+        std::vector< std::pair<Pixel, Count> > m_sparse;
+        unsigned int m_distinct;
+
+    public:
+    /**
+        Constructor
+        */
+        blockHistogram(): m_distinct(0)
+        {
+            std::fill(m_dense, m_dense + DENSE_DOMAIN, Count(0));
+        }
+
+        /**
+        
+        Adds count occurences of value to the histogram. 
+        
+        @param value - element to be counted
+               count - number of occurences to add
+        @return void      
+       */
+        void add(Pixel value, Count count = 1)
+        {
+            if(value < DENSE_DOMAIN)
+            {
+                if(m_dense[value] == 0) ++m_distinct;
+                m_dense[value] += count;
+                return;
+            }
+
+            if(m_sparse.size() == m_sparse.capacity()) instrumentation::add(&threadCounters::histogramAllocations);
+
+            //Values usually arrive in increasing order while merging, so check the end before searching
+            if(m_sparse.empty() || m_sparse.back().first < value)
+            {
+                m_sparse.push_back(std::make_pair(value, count));
+                ++m_distinct;
+                return;
+            }
+
+            auto position = std::lower_bound(m_sparse.begin(), m_sparse.end(), value,
+                                             [](const std::pair<Pixel, Count> & entry, Pixel key) { return entry.first < key; });
+
+            if(position != m_sparse.end() && position->first == value)
+            {
+                position->second += count;
+            }
+            else
+            {
+                m_sparse.insert(position, std::make_pair(value, count));
+                ++m_distinct;
+            }
+        }
+
+        /**
+        
+        Takes count occurences of value out of the histogram. The value is dropped once its count reaches 0. 
+        
+        @param value - element to be uncounted, it has to be present at least count times
+               count - number of occurences to remove
+        @return void      
+       */
+        void remove(Pixel value, Count count = 1)
+        {
+            if(value < DENSE_DOMAIN)
+            {
+                assert(m_dense[value] >= count);
+                m_dense[value] -= count;
+                if(m_dense[value] == 0) --m_distinct;
+                return;
+            }
+
+            auto position = std::lower_bound(m_sparse.begin(), m_sparse.end(), value,
+                                             [](const std::pair<Pixel, Count> & entry, Pixel key) { return entry.first < key; });
+
+            assert(position != m_sparse.end() && position->first == value && position->second >= count);
+            position->second -= count;
+            if(position->second == 0)
+            {
+                m_sparse.erase(position);
+                --m_distinct;
+            }
+        }
+
+        /**
+        
+        Calls visit(value, count) for every value present in the histogram, in increasing order of value. 
+        
+        @param visit - callable taking (Pixel value, Count count)
+        @return void      
+       */
+        template <typename Visitor>
+        void forEach(Visitor visit) const
+        {
+            for(unsigned int value = 0; value < DENSE_DOMAIN; ++value)
+            {
+                if(m_dense[value] != 0) visit(static_cast<Pixel>(value), m_dense[value]);
+            }
+
+            for(auto entry = m_sparse.begin(); entry != m_sparse.end(); ++entry)
+            {
+                visit(entry->first, entry->second);
+            }
+        }
+
+        //Number of distinct values in the histogram
+        size_t size() const { return m_distinct; }
+
+        //Number of distinct values kept in m_sparse
+        size_t sparseSize() const { return m_sparse.size(); }
+
+        //Reserve room for values that don't fit in m_dense
+        void reserveSparse(size_t entries)
+        {
+            if(entries > m_sparse.capacity()) instrumentation::add(&threadCounters::histogramAllocations);
+            m_sparse.reserve(entries);
+        }
+
+        //Remove all counts, keeping the sparse storage for reuse.
+        void clear()
+        {
+            std::fill(m_dense, m_dense + DENSE_DOMAIN, Count(0));
+            m_sparse.clear();
+            m_distinct = 0;
+        }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* This class manages the information about a 2x2 block of data. 
+* 
+* member variables m_mode and m_count store the mode value and its count .
+*
+* For example, for the 2x2 block shown below,
+*[  1,  1]
+*[  1,  2]
+* m_mode = 1
+* m_count = 3
+*
+* m_depth indicates how many recursive calls to startThreading happened befoe the object was createad.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class modeMap
+{
+	private:
+		blockHistogram<Pixel, Count> cube;
+		Pixel m_mode;
+		Count m_count;
+		int m_threadNumber;
+		int m_depth;
+
+     
+	public:
+    /**
+        Constructor
+        */
+		modeMap(): m_mode(0), m_count(0), m_threadNumber(0), m_depth(0)
+		{
+		}
+
+        //Copies are counted by the instrumentation, building a level should not make any
+        modeMap(const modeMap & other): cube(other.cube), m_mode(other.m_mode), m_count(other.m_count), m_threadNumber(other.m_threadNumber), m_depth(other.m_depth)
+        {
+            countCopy();
+        }
+
+        modeMap & operator=(const modeMap & other)
+        {
+            cube = other.cube;
+            m_mode = other.m_mode;
+            m_count = other.m_count;
+            m_threadNumber = other.m_threadNumber;
+            m_depth = other.m_depth;
+            countCopy();
+            return *this;
+        }
+
+        //Moves hand the histogram storage over, so cells can be moved around in vectors and level buffers without copying it
+        modeMap(modeMap && other) = default;
+        modeMap & operator=(modeMap && other) = default;
+		
+        size_t getMapSize() { return cube.size(); }
+
+        //True when every element the map counts has the same value, which is then the mode and getCount() the number of elements
+        bool isUniform() const { return cube.size() == 1; }
+		Pixel getMode() const { return m_mode; }
+
+		Count getCount() const { return m_count; }
+
+        //Empties the map so it can be filled again, keeping the storage of its histogram.
+        void clear() { cube.clear(); m_mode = 0; m_count = 0; }
+
+        //Setter function used when the mode and count were already found by a row pair kernel.
+        void setMode(Pixel mode, Count count) { m_mode = mode; m_count = count; }
+
+         /**
+        
+        Add's a new element to the map if it isn't present already.
+        Increases the value by one to count for the element in the 2x2 block.
+        
+        @param data - element to be added the map
+        @return void      
+       */
+		void addElement(Pixel data, Count count = 1)
+		{	
+			cube.add(data, count);
+            return;
+		}
+
+        /**
+        
+        Takes an element that has been added before out of the map. Used when an element of the block changes, 
+        calculateMode() has to be called again afterwards.
+        
+        @param data - element to be removed from the map
+        @return void      
+       */
+		void removeElement(Pixel data, Count count = 1)
+		{	
+			cube.remove(data, count);
+            return;
+		}
+
+        
+        /**
+        
+        Function to calcuate the mode and count of the 2x2 block. 
+        This function is called after the cube data member has been populated.
+        Among values with equal counts the smallest one is picked.
+        
+        @param void
+        @return void   
+        
+        */
+        
+		void calculateMode()
+		{		
+            m_mode = 0;
+            m_count = 0;
+			cube.forEach([this](Pixel value, Count count)
+			{	
+				if(count > m_count) 
+				{	
+					m_mode = value;
+					m_count = count;
+				}
+			});
+		}
+
+        
+        // Setter function to set the depth of the cube in the base image
+		void setDepth(int depth) { m_depth = depth; }
+	
+        // Setter function to set the threadNumber by which the cube was read by
+		void setthreadNumber(int threadNumber) { m_threadNumber = threadNumber; }
+
+        /**
+        
+        Adds every count of another map into this one, in place. calculateMode() has to be called once all of them have been merged.
+        
+        @param other - map to be merged
+               weight - number of times other is counted
+        @return void      
+       */
+        void merge(const modeMap & other, Count weight = 1)
+        {
+            other.cube.forEach([this, weight](Pixel value, Count count)
+            {
+                cube.add(value, count * weight);
+            });
+        }
+
+        modeMap & operator+=(const modeMap & other)
+        {
+            merge(other);
+            return *this;
+        }
+
+        //Overloaded operator used to merge modeMap objects. The left operand is taken by value, so a temporary on the left is 
+        //moved in and merged into rather than copied, and a chain like (a + b) + (c + d) copies only a and c.
+        friend modeMap operator+ (modeMap input1, const modeMap & input2)
+        {
+            input1 += input2;
+            return input1;
+        }
+        
+        //Getter function required for downsampling. 
+        blockHistogram<Pixel, Count> & getCube()
+        {
+            return cube;
+        }
+        
+        const blockHistogram<Pixel, Count> & getCube() const
+        {
+            return cube;
+        }
+
+    private:
+        void countCopy()
+        {
+            instrumentation::add(&threadCounters::bytesCopied, sizeof(modeMap) + cube.sparseSize() * sizeof(std::pair<Pixel, Count>));
+        }
+
+}; 
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Turns the summed counts of a merge into a Misra-Gries summary of at most K values. Used by the accumulators when an approximate 
+* mode is asked for, so that the cells of the upper levels stay bounded however many distinct values the image has.
+* 
+* The (K+1)-th largest count is subtracted from every count and the values left with nothing are dropped. 
+* Summaries merged this way keep every value occurring more than n/(K+1) times among the n elements a cell covers, 
+* and undercount it by at most n/(K+1), so merging costs O(K) per input instead of growing with the level.
+* The mode is picked from the summed counts before the subtraction, the smallest value winning among equal counts as in exact mode, 
+* and its count is a lower bound of the true count.
+*
+* m_counts - scratch space for finding the (K+1)-th largest count
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count>
+class misraGriesSummary
+{
+    private:
+        std::vector<Count> m_counts;
+
+    public:
+        /**
+        
+        Stores the summary of the summed counts, its mode and count in result. 
+        
+        @param entries - the summed (value, count) pairs, one per value in increasing order of value
+               topK - largest number of values kept
+               result - modeMap receiving the summary, it must be empty
+        @return void      
+       */
+        void finish(const std::vector< std::pair<Pixel, Count> > & entries, size_t topK, modeMap<Pixel, Count> & result)
+        {
+            Pixel mode = 0;
+            Count count = 0;
+            Count threshold = 0;
+
+            for(auto entry = entries.begin(); entry != entries.end(); ++entry)
+            {
+                if(entry->second > count) { mode = entry->first; count = entry->second; }
+            }
+
+            if(entries.size() > topK)
+            {
+                m_counts.clear();
+                for(auto entry = entries.begin(); entry != entries.end(); ++entry) m_counts.push_back(entry->second);
+                std::nth_element(m_counts.begin(), m_counts.begin() + topK, m_counts.end(), std::greater<Count>());
+                threshold = m_counts[topK];
+            }
+
+            for(auto entry = entries.begin(); entry != entries.end(); ++entry)
+            {
+                if(entry->second > threshold) result.addElement(entry->first, entry->second - threshold);
+            }
+
+            result.setMode(mode, count);
+        }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Merges the histograms of several modeMap objects into one, for element types with at most 16 bits. 
+* 
+* Counts are summed in m_table, a scratch table indexed directly by value, so adding an element is a single increment with no search. 
+* m_touched remembers which entries are in use, so finish() only visits and resets those. 
+* For 8 bit elements the whole table is scanned in order instead, which needs no sorting.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count>
+class directTableAccumulator
+{
+    private:
+        std::vector<Count> m_table;
+        std::vector<Pixel> m_touched;
+        std::vector< std::pair<Pixel, Count> > m_merged;
+        misraGriesSummary<Pixel, Count> m_summary;
+
+    public:
+    /**
+        Constructor
+        */
+        directTableAccumulator(): m_table(static_cast<size_t>(std::numeric_limits<Pixel>::max()) + 1, Count(0))
+        {
+        }
+
+        //Adds every count of a histogram
+        void add(const blockHistogram<Pixel, Count> & histogram)
+        {
+            histogram.forEach([this](Pixel value, Count count)
+            {
+                if(m_table[value] == 0) m_touched.push_back(value);
+                m_table[value] += count;
+            });
+        }
+
+        /**
+        
+        Stores the summed histogram, its mode and count in result and resets the accumulator. 
+        
+        @param result - modeMap receiving the merge, it must be empty
+               topK - 0 to keep every value, otherwise the size of the misraGriesSummary stored instead
+        @return void      
+       */
+        void finish(modeMap<Pixel, Count> & result, size_t topK = 0)
+        {
+            Pixel mode = 0;
+            Count count = 0;
+
+            if(topK > 0)
+            {
+                std::sort(m_touched.begin(), m_touched.end());
+                m_merged.clear();
+                for(auto value = m_touched.begin(); value != m_touched.end(); ++value)
+                {
+                    m_merged.push_back(std::make_pair(*value, m_table[*value]));
+                    m_table[*value] = 0;
+                }
+
+                m_touched.clear();
+                m_summary.finish(m_merged, topK, result);
+                return;
+            }
+
+            if(sizeof(Pixel) == 1)
+            {
+                for(size_t value = 0; value < m_table.size(); ++value)
+                {
+                    if(m_table[value] == 0) continue;
+
+                    result.addElement(static_cast<Pixel>(value), m_table[value]);
+                    if(m_table[value] > count) { mode = static_cast<Pixel>(value); count = m_table[value]; }
+                    m_table[value] = 0;
+                }
+            }
+            else
+            {
+                std::sort(m_touched.begin(), m_touched.end());
+                for(auto value = m_touched.begin(); value != m_touched.end(); ++value)
+                {
+                    result.addElement(*value, m_table[*value]);
+                    if(m_table[*value] > count) { mode = *value; count = m_table[*value]; }
+                    m_table[*value] = 0;
+                }
+            }
+
+            m_touched.clear();
+            result.setMode(mode, count);
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Merges the histograms of several modeMap objects into one, for 32 bit elements where a table indexed by value is too large. 
+* 
+* The (value, count) pairs of all inputs are collected in m_entries and sorted by value in finish(), 
+* which puts equal values next to each other so they can be summed in one pass.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count>
+class sortedMergeAccumulator
+{
+    private:
+        std::vector< std::pair<Pixel, Count> > m_entries;
+        misraGriesSummary<Pixel, Count> m_summary;
+
+    public:
+        //Adds every count of a histogram
+        void add(const blockHistogram<Pixel, Count> & histogram)
+        {
+            histogram.forEach([this](Pixel value, Count count)
+            {
+                m_entries.push_back(std::make_pair(value, count));
+            });
+        }
+
+        /**
+        
+        Stores the summed histogram, its mode and count in result and resets the accumulator. 
+        
+        @param result - modeMap receiving the merge, it must be empty
+               topK - 0 to keep every value, otherwise the size of the misraGriesSummary stored instead
+        @return void      
+       */
+        void finish(modeMap<Pixel, Count> & result, size_t topK = 0)
+        {
+            std::sort(m_entries.begin(), m_entries.end(),
+                      [](const std::pair<Pixel, Count> & first, const std::pair<Pixel, Count> & second) { return first.first < second.first; });
+
+            if(topK > 0)
+            {
+                //Sum equal values in place, then summarize
+                size_t merged = 0;
+                for(size_t i = 0; i < m_entries.size(); ++merged)
+                {
+                    std::pair<Pixel, Count> total(m_entries[i].first, 0);
+                    for(; i < m_entries.size() && m_entries[i].first == total.first; ++i) total.second += m_entries[i].second;
+                    m_entries[merged] = total;
+                }
+
+                m_entries.resize(merged);
+                m_summary.finish(m_entries, topK, result);
+                m_entries.clear();
+                return;
+            }
+
+            //Only values past the dense part of the histogram need room in its sparse part, the entries are sorted so they are at the end
+            auto sparse = std::lower_bound(m_entries.begin(), m_entries.end(), static_cast<Pixel>(DENSE_DOMAIN),
+                                           [](const std::pair<Pixel, Count> & entry, Pixel key) { return entry.first < key; });
+            if(sparse != m_entries.end()) result.getCube().reserveSparse(m_entries.end() - sparse);
+
+            Pixel mode = 0;
+            Count count = 0;
+
+            for(size_t i = 0; i < m_entries.size(); )
+            {
+                Pixel value = m_entries[i].first;
+                Count total = 0;
+                for(; i < m_entries.size() && m_entries[i].first == value; ++i) total += m_entries[i].second;
+
+                result.addElement(value, total);
+                if(total > count) { mode = value; count = total; }
+            }
+
+            m_entries.clear();
+            result.setMode(mode, count);
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Picks at compile time how histograms of an element type are merged while downsampling. 
+* 8 and 16 bit elements are counted in a direct table, wider elements are merged by sorting.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count>
+struct histogramStrategy
+{
+    typedef sortedMergeAccumulator<Pixel, Count> accumulator;
+};
+
+template <typename Count>
+struct histogramStrategy<uint8_t, Count>
+{
+    typedef directTableAccumulator<uint8_t, Count> accumulator;
+};
+
+template <typename Count>
+struct histogramStrategy<uint16_t, Count>
+{
+    typedef directTableAccumulator<uint16_t, Count> accumulator;
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Reduction operators, the value a cell of a level is reduced to. Every cell keeps the histogram of the elements it groups, 
+* so any of them can be read off the same levels: one pass over the base image by startThreading() and reduceGlobalMap() 
+* gives the mode, mean, min, max and median pyramids alike. They are passed as a policy to twoDArray::printDownsampled(), 
+* writeDownsampled() and copyModes(), which default to modeReduction.
+*
+* An operator is a callable taking a const modeMap and returning a Pixel, with 
+* name - the name "--reduce" knows it by
+* exactCounts - true when it reads the whole histogram, which levels built with twoDArray::setTopK() don't keep
+* ---------------------------------------------------------------
+*/
+
+//The most frequent value, the smallest one among equal counts. Found while the levels are built.
+template <typename Pixel, typename Count = unsigned int>
+struct modeReduction
+{
+    static const char * name() { return "mode"; }
+    static const bool exactCounts = false;
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const { return cell.getMode(); }
+};
+
+//The mean of the elements, rounded to the nearest value. 
+//With 32 bit counts the sum of 32 bit values fits in 64 bits, wider counts are summed in 128 bits.
+template <typename Pixel, typename Count = unsigned int>
+struct meanReduction
+{
+    typedef typename std::conditional<sizeof(Count) <= 4, unsigned long long, unsigned __int128>::type sumType;
+
+    static const char * name() { return "mean"; }
+    static const bool exactCounts = true;
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const
+    {
+        sumType sum = 0;
+        unsigned long long total = 0;
+        cell.getCube().forEach([&sum, &total](Pixel value, Count count)
+        {
+            sum += static_cast<sumType>(value) * count;
+            total += count;
+        });
+        return total ? static_cast<Pixel>((sum + total / 2) / total) : Pixel(0);
+    }
+};
+
+//The smallest element
+template <typename Pixel, typename Count = unsigned int>
+struct minReduction
+{
+    static const char * name() { return "min"; }
+    static const bool exactCounts = true;
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const
+    {
+        Pixel result = std::numeric_limits<Pixel>::max();
+        cell.getCube().forEach([&result](Pixel value, Count) { result = std::min(result, value); });
+        return result;
+    }
+};
+
+//The largest element
+template <typename Pixel, typename Count = unsigned int>
+struct maxReduction
+{
+    static const char * name() { return "max"; }
+    static const bool exactCounts = true;
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const
+    {
+        Pixel result = 0;
+        cell.getCube().forEach([&result](Pixel value, Count) { result = std::max(result, value); });
+        return result;
+    }
+};
+
+//The lower median, the smallest value that at least half of the elements are less than or equal to
+template <typename Pixel, typename Count = unsigned int>
+struct medianReduction
+{
+    static const char * name() { return "median"; }
+    static const bool exactCounts = true;
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const
+    {
+        unsigned long long total = 0, seen = 0;
+        cell.getCube().forEach([&total](Pixel, Count count) { total += count; });
+
+        Pixel result = 0;
+        bool found = false;
+        cell.getCube().forEach([&](Pixel value, Count count)
+        {
+            seen += count;
+            if(!found && 2 * seen >= total) { result = value; found = true; }
+        });
+        return result;
+    }
+};
+
+//The value with the largest count times weight, the smallest one among equal products. 
+//m_weights is indexed by value, values past its end weigh 1.
+template <typename Pixel, typename Count = unsigned int>
+struct weightedModeReduction
+{
+    static const char * name() { return "weighted"; }
+    static const bool exactCounts = false;
+
+    std::vector<double> m_weights;
+
+    explicit weightedModeReduction(const std::vector<double> & weights = std::vector<double>()): m_weights(weights)
+    {
+    }
+
+    Pixel operator()(const modeMap<Pixel, Count> & cell) const
+    {
+        Pixel result = 0;
+        double best = -1;
+        cell.getCube().forEach([this, &result, &best](Pixel value, Count count)
+        {
+            double score = count * (value < m_weights.size() ? m_weights[value] : 1.0);
+            if(score > best) { result = value; best = score; }
+        });
+        return result;
+    }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* How a 2x2 block running past the last row or col of an image or level with an odd number of rows or cols is handled.
+*
+* partialBlocks - the block is made of the elements that exist, the next level has ceil(n/2) rows or cols
+* replicateEdge - the missing elements are copies of the last row or col, the next level has ceil(n/2) rows or cols
+* ignoreEdge - the block is dropped along with the last row or col, the next level has floor(n/2) rows or cols
+*
+* An axis that is down to 1 stays at 1 under every policy, the blocks then only group along the other axis. 
+* The pyramid ends once both axes are at 1.
+* ---------------------------------------------------------------
+*/
+enum edgePolicy { partialBlocks, replicateEdge, ignoreEdge };
+
+//Rows or cols of the next level for a level with size rows or cols
+int nextLevelDim(int size, edgePolicy policy)
+{
+    if(size <= 1) return size;
+    return (policy == ignoreEdge) ? size / 2 : (size + 1) / 2;
+}
+
+//Policy used along an axis of the given size. An axis of size 1 is never padded or dropped.
+edgePolicy axisPolicy(edgePolicy policy, int size)
+{
+    return (size == 1) ? partialBlocks : policy;
+}
+
+//Returns size after checking that it can be the rows or cols of an image, throws std::runtime_error when it is less than 1
+int checkedDim(int size)
+{
+    if(size < 1) throw std::runtime_error("dimensions and channels have to be at least 1");
+    return size;
+}
+
+/**
+            
+            Number of downsampled levels of an image, the same number printDownsampled() prints. 
+            Both axes are reduced with nextLevelDim() until they are at 1.
+             
+             @param 
+                    rows, cols - dimensions of the base image
+                    policy - edge handling used for the levels
+             @return 
+                    number of levels, log2(max(rows, cols)) for powers of 2           
+            */
+int pyramidLevelCount(int rows, int cols, edgePolicy policy = partialBlocks)
+{
+    int levels = 0;
+    while(rows > 1 || cols > 1)
+    {
+        rows = nextLevelDim(rows, policy);
+        cols = nextLevelDim(cols, policy);
+        ++levels;
+    }
+    return levels;
+}
+
+/**
+            
+            Number of elements counted by the top cell of a pyramid, the largest count of any of its cells. 
+            Under replicateEdge the copies of a lone last index are counted again, so such an axis counts as the next power of 2. 
+            Stops at the largest unsigned long long instead of wrapping.
+             
+             @param 
+                    dims - size of every axis of the base image
+                    policy - edge handling used for the levels
+             @return 
+                    the largest count of a cell           
+            */
+unsigned long long pyramidCellElements(const std::vector<int> & dims, edgePolicy policy)
+{
+    const unsigned long long limit = std::numeric_limits<unsigned long long>::max();
+    unsigned long long elements = 1;
+    for(int dim : dims)
+    {
+        unsigned long long counted = static_cast<unsigned long long>(std::max(1, dim));
+        if(policy == replicateEdge)
+        {
+            counted = 1;
+            while(counted < static_cast<unsigned long long>(dim)) counted *= 2;
+        }
+        elements = (elements > limit / counted) ? limit : elements * counted;
+    }
+    return elements;
+}
+
+//Throws std::runtime_error when a cell of a pyramid with the given dimensions counts more elements than Count can hold
+template <typename Count>
+void checkCountFits(const std::vector<int> & dims, edgePolicy policy)
+{
+    if(pyramidCellElements(dims, policy) > std::numeric_limits<Count>::max()) 
+        throw std::runtime_error("the image has more elements than its histograms can count");
+}
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* This class is one level of the downsampled image, a contiguous, row-major grid of modeMap objects. 
+* It does not own the cells, they are part of the region a pyramidArena reserves for all levels of an image, so levels are cheap to copy.
+* 
+* m_rows, m_cols - number of rows and cols of modeMap objects in this level
+* m_cells - the modeMap objects, cell (row, col) is stored at m_cells[row*m_cols + col]
+*
+* Cell (row, col) of the next level groups the cells (2row, 2col), (2row, 2col+1), (2row+1, 2col) and (2row+1, 2col+1) of this level. 
+* Groups running past the last row or col are handled according to an edgePolicy.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class pyramidLevel
+{
+    public:
+        typedef modeMap<Pixel, Count> cellType;
+
+    private:
+        int m_rows, m_cols;
+        cellType * m_cells;
+
+    public:
+    /**
+        Constructor
+        
+        @param rows, cols - size of the level
+               cells - rows*cols modeMap objects, owned by the caller
+        */
+        pyramidLevel(int rows = 0, int cols = 0, cellType * cells = nullptr): m_rows(rows), m_cols(cols), m_cells(cells)
+        {
+        }
+
+        int getRows() const { return m_rows; }
+
+        int getCols() const { return m_cols; }
+
+        size_t size() const { return static_cast<size_t>(m_rows) * m_cols; }
+
+        cellType & at(int row, int col) { return m_cells[static_cast<size_t>(row) * m_cols + col]; }
+
+        //Cell at a zero based row-major index
+        cellType & cell(size_t index) { return m_cells[index]; }
+
+        //Pointer to the first modeMap of a row. The cells of a row are contiguous.
+        cellType * row(int row) { return &m_cells[static_cast<size_t>(row) * m_cols]; }
+
+        /**
+        
+        Builds the next level from this one with a strided 2x2 gather. 
+        Two adjacent rows of this level are walked left to right, so every row is read sequentially exactly once.
+        
+        @param coarser - level that receives the result, nextLevelDim() of this one along both axes. Its cells must be empty.
+               policy - handling of the last row and col when there is an odd number of them
+               topK - 0 for exact histograms, otherwise the cells of coarser hold misraGriesSummary objects of at most topK values
+        @return void      
+       */
+        void reduceInto(pyramidLevel & coarser, edgePolicy policy = partialBlocks, size_t topK = 0)
+        {
+            reduceRegion(coarser, policy, topK, 0, coarser.m_rows, 0, coarser.m_cols);
+        }
+
+        /**
+        
+        Fills the rectangle [rowStart, rowEnd) x [colStart, colEnd) of the next level, the same way reduceInto() fills all of it. 
+        Rectangles that don't overlap only read and write their own cells, so several threads can fill the same level at once.
+        
+        @param coarser - level that receives the result, nextLevelDim() of this one along both axes. The cells of the rectangle must be empty.
+               policy - handling of the last row and col when there is an odd number of them
+               topK - 0 for exact histograms, otherwise the size of the summaries stored in coarser
+               rowStart, rowEnd - rows of coarser to fill
+               colStart, colEnd - cols of coarser to fill
+        @return void      
+       */
+        void reduceRegion(pyramidLevel & coarser, edgePolicy policy, size_t topK, int rowStart, int rowEnd, int colStart, int colEnd)
+        {
+            assert(coarser.m_rows == nextLevelDim(m_rows, policy) && coarser.m_cols == nextLevelDim(m_cols, policy));
+            edgePolicy rowPolicy = axisPolicy(policy, m_rows);
+            int cols = std::min(m_cols, 2 * colEnd) - 2 * colStart;
+
+            for(int r = rowStart; r < rowEnd; ++r)
+            {
+                cellType * bottom = nullptr;
+                if(2 * r + 1 < m_rows) bottom = row(2 * r + 1);
+                else if(rowPolicy == replicateEdge) bottom = row(2 * r);
+
+                reduceRowPair(row(2 * r) + 2 * colStart, bottom ? bottom + 2 * colStart : nullptr, cols, colEnd - colStart, 
+                              axisPolicy(policy, m_cols), coarser.row(r) + colStart, topK);
+            }
+        }
+
+        /**
+        
+        Groups the cells of two adjacent rows of a level into one row of the next level. 
+        The four histograms of a group are merged with the accumulator histogramStrategy picks for Pixel, one per thread. 
+        With exact counts a group of uniform cells holding the same value is uniform too, so its cell is set without merging, 
+        which makes uniform regions such as the background of a label raster cost O(1) per cell on every level.
+        
+        @param top, bottom - the two rows, each holding cols cells. bottom is null when the last row of a level is grouped on its own.
+               cols - number of cells in a row
+               outCols - number of cells written to out, cols/2 or (cols+1)/2
+               colPolicy - axisPolicy() for the cols, decides what the last cell of out is made of when cols is odd
+               out - receives the grouped cells with their mode and count, they must be empty
+               topK - 0 for exact histograms, otherwise the size of the summaries stored in out
+        @return void      
+       */
+        static void reduceRowPair(cellType * top, cellType * bottom, int cols, int outCols, edgePolicy colPolicy, cellType * out, size_t topK = 0)
+        {
+            static thread_local typename histogramStrategy<Pixel, Count>::accumulator merge;
+            int pairs = std::min(outCols, cols / 2);
+            uint64_t uniform = 0;
+
+            for(int c = 0; c < pairs; ++c)
+            {
+                if(topK == 0 && sameUniform(top[2 * c], top[2 * c + 1]) && (!bottom || (sameUniform(top[2 * c], bottom[2 * c]) && sameUniform(top[2 * c], bottom[2 * c + 1]))))
+                {
+                    Pixel value = top[2 * c].getMode();
+                    Count count = top[2 * c].getCount() + top[2 * c + 1].getCount();
+                    if(bottom) count += bottom[2 * c].getCount() + bottom[2 * c + 1].getCount();
+                    out[c].addElement(value, count);
+                    out[c].setMode(value, count);
+                    ++uniform;
+                    continue;
+                }
+
+                merge.add(top[2 * c].getCube());
+                merge.add(top[2 * c + 1].getCube());
+                if(bottom)
+                {
+                    merge.add(bottom[2 * c].getCube());
+                    merge.add(bottom[2 * c + 1].getCube());
+                }
+                merge.finish(out[c], topK);
+            }
+
+            //The last group only has the last col, which is added twice when it is replicated
+            if(pairs < outCols)
+            {
+                int copies = (colPolicy == replicateEdge) ? 2 : 1;
+                for(int copy = 0; copy < copies; ++copy)
+                {
+                    merge.add(top[cols - 1].getCube());
+                    if(bottom) merge.add(bottom[cols - 1].getCube());
+                }
+                merge.finish(out[pairs], topK);
+            }
+            instrumentation::add(&threadCounters::uniformCells, uniform);
+        }
+
+    private:
+        //True when both cells are uniform with the same value
+        static bool sameUniform(const cellType & first, const cellType & second)
+        {
+            return first.isUniform() && second.isUniform() && first.getMode() == second.getMode();
+        }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Storage for every level of an image in one reserved region of modeMap objects, handed out as pyramidLevel views. 
+* 
+* prepare() lays the levels out back to back for the given dimensions. The region only grows, and cells are cleared rather than 
+* destroyed between runs, so their histograms keep their storage too. An arena used again for images of the same dimensions 
+* therefore makes no heap allocation after the first run, and threads reducing levels in parallel never go through the allocator.
+*
+* m_cells, m_capacity - the region, at least as large as the largest image prepared so far needs
+* m_levels - views of the levels of the last prepared image, level 0 is the image of 2x2 block modes
+* m_pool - a pinned workStealingPool, or null. The region is then constructed and cleared band by band on the worker 
+*          workerForRow() gives each band of rows, so the pages of every level are first touched on the node that later reduces them.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class pyramidArena
+{
+    public:
+        typedef pyramidLevel<Pixel, Count> levelType;
+        typedef modeMap<Pixel, Count> cellType;
+
+    private:
+        cellType * m_cells;
+        size_t m_capacity;
+        std::vector<levelType> m_levels;
+        workStealingPool * m_pool;
+
+        //Constructs the cells [first, last) of a new region, or clears them in a region that already holds them
+        static void resetCells(cellType * cells, size_t first, size_t last, bool construct)
+        {
+            for(size_t i = first; i < last; ++i)
+            {
+                if(construct) new (cells + i) cellType();
+                else cells[i].clear();
+            }
+        }
+
+        //Destroys the cells and frees the region
+        void release()
+        {
+            for(size_t i = 0; i < m_capacity; ++i) m_cells[i].~cellType();
+            ::operator delete(m_cells);
+            m_cells = nullptr;
+            m_capacity = 0;
+        }
+
+    public:
+    /**
+        Constructor, the region is reserved by the first call to prepare()
+        
+        @param pool - pinned pool placing the cells of every level on the node that reduces them, or null
+        */
+        explicit pyramidArena(workStealingPool * pool = nullptr): m_cells(nullptr), m_capacity(0), m_pool(pool)
+        {
+        }
+
+        //The levels point into m_cells, so an arena can be moved but not copied
+        pyramidArena(const pyramidArena &) = delete;
+        pyramidArena & operator=(const pyramidArena &) = delete;
+
+        pyramidArena(pyramidArena && other): m_cells(other.m_cells), m_capacity(other.m_capacity), m_levels(std::move(other.m_levels)), m_pool(other.m_pool)
+        {
+            other.m_cells = nullptr;
+            other.m_capacity = 0;
+        }
+
+        pyramidArena & operator=(pyramidArena && other)
+        {
+            if(this != &other)
+            {
+                release();
+                m_cells = other.m_cells;
+                m_capacity = other.m_capacity;
+                m_levels = std::move(other.m_levels);
+                m_pool = other.m_pool;
+                other.m_cells = nullptr;
+                other.m_capacity = 0;
+            }
+            return *this;
+        }
+
+        ~pyramidArena()
+        {
+            release();
+        }
+
+        /**
+        
+        Lays out the levels of a rows x cols image, growing the region if it is too small, and empties the cells of every level. 
+        There is always a level 0, even for a 1x1 image.
+        
+        @param rows, cols - dimensions of the base image
+               policy - edge handling that decides the sizes of the levels
+        @return void      
+       */
+        void prepare(int rows, int cols, edgePolicy policy)
+        {
+            int levelCount = std::max(1, pyramidLevelCount(rows, cols, policy));
+            size_t total = 0;
+            
+            m_levels.resize(levelCount);
+            for(int level = 0; level < levelCount; ++level)
+            {
+                rows = nextLevelDim(rows, policy);
+                cols = nextLevelDim(cols, policy);
+                m_levels[level] = levelType(rows, cols);
+                total += static_cast<size_t>(rows) * cols;
+            }
+
+            //A new region is left untouched by the allocator, its cells are constructed below along with the clearing
+            bool construct = m_capacity < total;
+            if(construct)
+            {
+                release();
+                m_cells = static_cast<cellType *>(::operator new(total * sizeof(cellType)));
+                m_capacity = total;
+            }
+
+            size_t offset = 0;
+            for(int level = 0; level < levelCount; offset += m_levels[level].size(), ++level)
+            {
+                m_levels[level] = levelType(m_levels[level].getRows(), m_levels[level].getCols(), m_cells + offset);
+            }
+
+            if(!m_pool || !m_pool->isPinned() || total < REDUCE_BAND_CELLS)
+            {
+                resetCells(m_cells, 0, total, construct);
+                return;
+            }
+
+            taskGroup group(*m_pool);
+            cellType * cells = m_cells;
+            offset = 0;
+            for(int level = 0; level < levelCount; offset += m_levels[level].size(), ++level)
+            {
+                int levelRows = m_levels[level].getRows(), levelCols = m_levels[level].getCols();
+                int workers = static_cast<int>(std::min<size_t>(m_pool->getThreadCount(), levelRows));
+                for(int worker = 0; worker < workers; ++worker)
+                {
+                    size_t first = offset + static_cast<size_t>(levelRows * worker / workers) * levelCols;
+                    size_t last = offset + static_cast<size_t>(levelRows * (worker + 1) / workers) * levelCols;
+                    group.run([=]() { resetCells(cells, first, last, construct); }, m_pool->workerForRow(levelRows * worker / workers, levelRows));
+                }
+            }
+            group.wait();
+        }
+
+        //Number of levels laid out by the last prepare()
+        int getLevelCount() const { return static_cast<int>(m_levels.size()); }
+
+        levelType & getLevel(int level) { return m_levels[level]; }
+
+        //Number of modeMap objects in the region
+        size_t capacity() const { return m_capacity; }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Kernels that find the mode and count of every 2x2 block in a pair of adjacent rows of the baseImage.
+* 
+* Block i is made of top[2i], top[2i+1], bottom[2i], bottom[2i+1]. 
+* The count of each of the four elements is found with pairwise equality compares, so no histogram is needed. 
+* Counts are at most 4, so they are returned in the element type and share its lane width.
+* Like modeMap::calculateMode() the smallest value wins among equal counts.
+*
+* rowPairModeScalar works everywhere. On x86 the SSE4.1 version handles 16, 8 or 4 blocks per step for 8, 16 and 32 bit elements, 
+* and the AVX2 version 8 blocks of 32 bit elements. selectRowPairModeKernel() picks the widest one the running CPU supports.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+struct rowPairModeKernel
+{
+    typedef void (*type)(const Pixel * top, const Pixel * bottom, int blocks, Pixel * modes, Pixel * counts);
+};
+
+/**
+            
+            Portable version of the row pair kernel.
+             
+             @param 
+                    top, bottom - the two rows of the baseImage, each holding 2*blocks elements
+                    blocks - number of 2x2 blocks in the row pair
+                    modes, counts - receive the mode and count of every block
+             @return 
+                    void           
+            */
+template <typename Pixel>
+void rowPairModeScalar(const Pixel * top, const Pixel * bottom, int blocks, Pixel * modes, Pixel * counts)
+{
+    for(int i = 0; i < blocks; ++i)
+    {
+        Pixel value[4] = { top[2*i], top[2*i + 1], bottom[2*i], bottom[2*i + 1] };
+
+        Pixel mode = value[0];
+        unsigned int count = 0;
+        for(int a = 0; a < 4; ++a)
+        {
+            unsigned int occurences = 0;
+            for(int b = 0; b < 4; ++b) occurences += (value[a] == value[b]);
+
+            if(occurences > count || (occurences == count && value[a] < mode))
+            {
+                mode = value[a];
+                count = occurences;
+            }
+        }
+
+        modes[i] = mode;
+        counts[i] = static_cast<Pixel>(count);
+    }
+}
+
+#ifdef DOWNSAMPLE_X86_KERNELS
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* SSE4.1 operations of rowPairModeSSE4 for each element width. 
+* split() loads 2*lanes consecutive elements and returns the even columns in evens and the odd columns in odds, in order.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel> struct sse4Lanes;
+
+template <> struct sse4Lanes<uint8_t>
+{
+    static const int lanes = 16;
+
+    __attribute__((target("sse4.1"))) static inline void split(const uint8_t * source, __m128i & evens, __m128i & odds)
+    {
+        __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source));
+        __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 16));
+        __m128i low = _mm_set1_epi16(0x00FF);
+
+        evens = _mm_packus_epi16(_mm_and_si128(first, low), _mm_and_si128(second, low));
+        odds = _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8));
+    }
+
+    __attribute__((target("sse4.1"))) static inline __m128i one() { return _mm_set1_epi8(1); }
+    __attribute__((target("sse4.1"))) static inline __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i greater(__m128i a, __m128i b) { return _mm_cmpgt_epi8(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i minimum(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i subtract(__m128i a, __m128i b) { return _mm_sub_epi8(a, b); }
+};
+
+template <> struct sse4Lanes<uint16_t>
+{
+    static const int lanes = 8;
+
+    __attribute__((target("sse4.1"))) static inline void split(const uint16_t * source, __m128i & evens, __m128i & odds)
+    {
+        __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source));
+        __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 8));
+        __m128i low = _mm_set1_epi32(0xFFFF);
+
+        evens = _mm_packus_epi32(_mm_and_si128(first, low), _mm_and_si128(second, low));
+        odds = _mm_packus_epi32(_mm_srli_epi32(first, 16), _mm_srli_epi32(second, 16));
+    }
+
+    __attribute__((target("sse4.1"))) static inline __m128i one() { return _mm_set1_epi16(1); }
+    __attribute__((target("sse4.1"))) static inline __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i greater(__m128i a, __m128i b) { return _mm_cmpgt_epi16(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i minimum(__m128i a, __m128i b) { return _mm_min_epu16(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i subtract(__m128i a, __m128i b) { return _mm_sub_epi16(a, b); }
+};
+
+template <> struct sse4Lanes<uint32_t>
+{
+    static const int lanes = 4;
+
+    __attribute__((target("sse4.1"))) static inline void split(const uint32_t * source, __m128i & evens, __m128i & odds)
+    {
+        __m128 first = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(source)));
+        __m128 second = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 4)));
+
+        evens = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0)));
+        odds = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+
+    __attribute__((target("sse4.1"))) static inline __m128i one() { return _mm_set1_epi32(1); }
+    __attribute__((target("sse4.1"))) static inline __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i greater(__m128i a, __m128i b) { return _mm_cmpgt_epi32(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i minimum(__m128i a, __m128i b) { return _mm_min_epu32(a, b); }
+    __attribute__((target("sse4.1"))) static inline __m128i subtract(__m128i a, __m128i b) { return _mm_sub_epi32(a, b); }
+};
+
+//Replaces the running best (mode, count) with (value, occurences) where value has a higher count, or an equal count and a smaller value.
+template <typename Pixel>
+__attribute__((target("sse4.1")))
+static inline void keepBestSSE4(__m128i value, __m128i occurences, __m128i & mode, __m128i & count)
+{
+    typedef sse4Lanes<Pixel> ops;
+
+    __m128i higher = ops::greater(occurences, count);
+    __m128i equal = ops::equal(occurences, count);
+    __m128i notSmaller = ops::equal(ops::minimum(value, mode), mode);
+    __m128i take = _mm_or_si128(higher, _mm_andnot_si128(notSmaller, equal));
+
+    mode = _mm_blendv_epi8(mode, value, take);
+    count = _mm_blendv_epi8(count, occurences, take);
+}
+
+template <typename Pixel>
+__attribute__((target("sse4.1")))
+void rowPairModeSSE4(const Pixel * top, const Pixel * bottom, int blocks, Pixel * modes, Pixel * counts)
+{
+    typedef sse4Lanes<Pixel> ops;
+
+    const __m128i one = ops::one();
+    int i = 0;
+
+    for(; i + ops::lanes <= blocks; i += ops::lanes)
+    {
+        //Split even and odd columns so that lane j holds the elements of block i+j
+        __m128i a, b, c, d;
+        ops::split(top + 2*i, a, b);
+        ops::split(bottom + 2*i, c, d);
+
+        //Equality masks are -1, so subtracting them counts the matches
+        __m128i ab = ops::equal(a, b), ac = ops::equal(a, c), ad = ops::equal(a, d);
+        __m128i bc = ops::equal(b, c), bd = ops::equal(b, d), cd = ops::equal(c, d);
+
+        __m128i countA = ops::subtract(ops::subtract(ops::subtract(one, ab), ac), ad);
+        __m128i countB = ops::subtract(ops::subtract(ops::subtract(one, ab), bc), bd);
+        __m128i countC = ops::subtract(ops::subtract(ops::subtract(one, ac), bc), cd);
+        __m128i countD = ops::subtract(ops::subtract(ops::subtract(one, ad), bd), cd);
+
+        __m128i mode = a, count = countA;
+        keepBestSSE4<Pixel>(b, countB, mode, count);
+        keepBestSSE4<Pixel>(c, countC, mode, count);
+        keepBestSSE4<Pixel>(d, countD, mode, count);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(modes + i), mode);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(counts + i), count);
+    }
+
+    rowPairModeScalar(top + 2*i, bottom + 2*i, blocks - i, modes + i, counts + i);
+}
+
+//Same as keepBestSSE4() for 8 lanes of 32 bit elements.
+__attribute__((target("avx2")))
+static inline void keepBestAVX2(__m256i value, __m256i occurences, __m256i & mode, __m256i & count)
+{
+    __m256i higher = _mm256_cmpgt_epi32(occurences, count);
+    __m256i equal = _mm256_cmpeq_epi32(occurences, count);
+    __m256i notSmaller = _mm256_cmpeq_epi32(_mm256_min_epu32(value, mode), mode);
+    __m256i take = _mm256_or_si256(higher, _mm256_andnot_si256(notSmaller, equal));
+
+    mode = _mm256_blendv_epi8(mode, value, take);
+    count = _mm256_blendv_epi8(count, occurences, take);
+}
+
+//Loads 16 consecutive elements and returns the even columns in evens and the odd columns in odds, in order.
+__attribute__((target("avx2")))
+static inline void splitColumnsAVX2(const uint32_t * source, __m256i & evens, __m256i & odds)
+{
+    __m256 first = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(source)));
+    __m256 second = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + 8)));
+
+    //The shuffle works inside 128 bit lanes, the permute puts the four 64 bit halves back in order
+    evens = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0));
+    odds = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+void rowPairModeAVX2(const uint32_t * top, const uint32_t * bottom, int blocks, uint32_t * modes, uint32_t * counts)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    int i = 0;
+
+    for(; i + 8 <= blocks; i += 8)
+    {
+        __m256i a, b, c, d;
+        splitColumnsAVX2(top + 2*i, a, b);
+        splitColumnsAVX2(bottom + 2*i, c, d);
+
+        __m256i ab = _mm256_cmpeq_epi32(a, b), ac = _mm256_cmpeq_epi32(a, c), ad = _mm256_cmpeq_epi32(a, d);
+        __m256i bc = _mm256_cmpeq_epi32(b, c), bd = _mm256_cmpeq_epi32(b, d), cd = _mm256_cmpeq_epi32(c, d);
+
+        __m256i countA = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_sub_epi32(one, ab), ac), ad);
+        __m256i countB = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_sub_epi32(one, ab), bc), bd);
+        __m256i countC = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_sub_epi32(one, ac), bc), cd);
+        __m256i countD = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_sub_epi32(one, ad), bd), cd);
+
+        __m256i mode = a, count = countA;
+        keepBestAVX2(b, countB, mode, count);
+        keepBestAVX2(c, countC, mode, count);
+        keepBestAVX2(d, countD, mode, count);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(modes + i), mode);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(counts + i), count);
+    }
+
+    rowPairModeSSE4(top + 2*i, bottom + 2*i, blocks - i, modes + i, counts + i);
+}
+
+#endif
+
+//Picks the widest row pair kernel supported by the CPU the program is running on.
+template <typename Pixel>
+typename rowPairModeKernel<Pixel>::type selectRowPairModeKernel()
+{
+#ifdef DOWNSAMPLE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.1")) return &rowPairModeSSE4<Pixel>;
+#endif
+    return &rowPairModeScalar<Pixel>;
+}
+
+template <>
+rowPairModeKernel<uint32_t>::type selectRowPairModeKernel<uint32_t>()
+{
+#ifdef DOWNSAMPLE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return &rowPairModeAVX2;
+    if(__builtin_cpu_supports("sse4.1")) return &rowPairModeSSE4<uint32_t>;
+#endif
+    return &rowPairModeScalar<uint32_t>;
+}
+
+/**
+            
+            Function to create a modeMap object for every 2x2 block of a pair of rows. The modes and counts of the whole row pair are found at once by the row pair kernel, 
+            then the four elements of each block are added to its modeMap. A uniform block, a count of 4, is added in one step.
+             
+             @param 
+                    top, bottom - the two rows of the baseImage, each holding 2*blocks elements
+                    blocks - number of 2x2 blocks in the row pair
+                    out - receives one modeMap per block, they must be empty
+             @return 
+                    void           
+            */
+template <typename Pixel, typename Count>
+void buildRowPairBlocks(const Pixel * top, const Pixel * bottom, int blocks, modeMap<Pixel, Count> * out)
+{
+    static const typename rowPairModeKernel<Pixel>::type kernel = selectRowPairModeKernel<Pixel>();
+    
+    //Blocks are handled in chunks so that the kernel output stays on the stack
+    const int chunkBlocks = 256;
+    Pixel modes[chunkBlocks], counts[chunkBlocks];
+    uint64_t uniform = 0;
+    
+    for(int chunkStart = 0; chunkStart < blocks; chunkStart += chunkBlocks)
+    {
+        int chunk = std::min(chunkBlocks, blocks - chunkStart);
+        kernel(top + 2*chunkStart, bottom + 2*chunkStart, chunk, modes, counts);
+        
+        for(int b = 0; b < chunk; ++b)
+        {
+            int col = 2*(chunkStart + b);
+            modeMap<Pixel, Count> & result = out[chunkStart + b];
+            
+            if(counts[b] == 4)
+            {
+                result.addElement(modes[b], 4);
+                result.setMode(modes[b], 4);
+                ++uniform;
+                continue;
+            }
+            
+            result.addElement(top[col]);
+            result.addElement(top[col + 1]);
+            result.addElement(bottom[col]);
+            result.addElement(bottom[col + 1]);
+            result.setMode(modes[b], counts[b]);
+        }
+    }
+    instrumentation::add(&threadCounters::uniformCells, uniform);
+}
+
+
+/**
+            
+            Function to find the modes of one row of blocks of the baseImage. Complete 2x2 blocks go through buildRowPairBlocks(), 
+            the blocks of a lone last row and the block of a lone last col are counted one element at a time.
+             
+             @param 
+                    top - first row of the blocks
+                    bottom - second row of the blocks, top again to replicate a lone last row, or null to use top on its own
+                    width - number of elements in a row, odd only when the last col of the image is included
+                    colPolicy - axisPolicy() for the cols of the image, decides what is done with a lone last col
+                    out - receives one modeMap per block, they must be empty
+             @return 
+                    void           
+            */
+template <typename Pixel, typename Count>
+void buildBlockRow(const Pixel * top, const Pixel * bottom, int width, edgePolicy colPolicy, modeMap<Pixel, Count> * out)
+{
+    int blocks = width / 2;
+    
+    if(bottom) buildRowPairBlocks(top, bottom, blocks, out);
+    else
+    {
+        for(int b = 0; b < blocks; ++b)
+        {
+            out[b].addElement(top[2*b]);
+            out[b].addElement(top[2*b + 1]);
+            out[b].calculateMode();
+        }
+    }
+    
+    if(width % 2 == 0 || colPolicy == ignoreEdge) return;
+    
+    Count copies = (colPolicy == replicateEdge) ? 2 : 1;
+    out[blocks].addElement(top[width - 1], copies);
+    if(bottom) out[blocks].addElement(bottom[width - 1], copies);
+    out[blocks].calculateMode();
+}
+
+
+//Splits [start, end) as close to the middle as possible at a multiple of alignment from start
+int alignedMidpoint(int start, int end, int alignment)
+{
+    return start + alignment * ((end - start + alignment) / (2 * alignment));
+}
+
+//Splits [start, end) as close to the middle as possible at an even offset from start, so no 2x2 block straddles the split
+int evenMidpoint(int start, int end)
+{
+    return alignedMidpoint(start, end, 2);
+}
+
+
+//Rows and cols of the square tiles of a mortonLayout, a power of 2. A tile of 32 bit elements is 16KB, so it stays in L1 while its blocks are read.
+#define MORTON_TILE 64
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Z-order layout of an image, used by twoDArray::useMortonLayout(). 
+* 
+* The image is cut into MORTON_TILE x MORTON_TILE tiles stored one after the other in row-major order, the last row and col of tiles 
+* padded to full size. Inside a tile the elements follow the Z-order curve: the bits of the row and col within the tile are interleaved, 
+* a row bit above each col bit. The four elements of every aligned 2x2 block are then adjacent, top row first, and every aligned 
+* quadrant of a tile, down to the 2x2 blocks, is a contiguous range of memory.
+*
+* m_tileCols - number of tiles in a row of tiles
+* m_size - number of elements stored, padding included
+* m_spread - the bits of every row or col within a tile spread to the even bits
+* ---------------------------------------------------------------
+*/
+class mortonLayout
+{
+    private:
+        int m_tileCols;
+        size_t m_size;
+        std::vector<size_t> m_spread;
+
+    public:
+    /**
+        Constructor
+        
+        @param rows, cols - dimensions of the image
+        */
+        mortonLayout(int rows = 0, int cols = 0): m_tileCols((cols + MORTON_TILE - 1) / MORTON_TILE), 
+                                                  m_size(static_cast<size_t>((rows + MORTON_TILE - 1) / MORTON_TILE) * m_tileCols * MORTON_TILE * MORTON_TILE), 
+                                                  m_spread(MORTON_TILE, 0)
+        {
+            for(int value = 0; value < MORTON_TILE; ++value)
+            {
+                for(int bit = 0; (value >> bit) != 0; ++bit) m_spread[value] |= static_cast<size_t>((value >> bit) & 1) << (2 * bit);
+            }
+        }
+
+        //Number of elements stored, padding included
+        size_t size() const { return m_size; }
+
+        //Position of an element
+        size_t offset(int row, int col) const
+        {
+            size_t tile = static_cast<size_t>(row / MORTON_TILE) * m_tileCols + col / MORTON_TILE;
+            return tile * MORTON_TILE * MORTON_TILE + (m_spread[row % MORTON_TILE] << 1 | m_spread[col % MORTON_TILE]);
+        }
+
+        /**
+        
+        Copies a row-major image into this layout. 
+        
+        @param source - rows x cols elements in row-major order
+               rows, cols - dimensions of the image this layout was made for
+               destination - receives size() elements, the padding is left as it is
+        @return void      
+       */
+        template <typename Pixel>
+        void fromRowMajor(const Pixel * source, int rows, int cols, Pixel * destination) const
+        {
+            for(int row = 0; row < rows; ++row)
+            {
+                for(int col = 0; col < cols; ++col) destination[offset(row, col)] = source[static_cast<size_t>(row) * cols + col];
+            }
+        }
+
+        /**
+        
+        Copies cols [colStart, colEnd) of two adjacent rows out of an image in this layout, a 2x2 block at a time. 
+        
+        @param image - the elements in this layout
+               row - first of the two rows, even
+               colStart, colEnd - cols to copy, colStart even
+               top, bottom - receive colEnd - colStart elements of each row. bottom is null to copy only the first row.
+        @return void      
+       */
+        template <typename Pixel>
+        void readRowPair(const Pixel * image, int row, int colStart, int colEnd, Pixel * top, Pixel * bottom) const
+        {
+            for(int col = colStart; col < colEnd; col += 2)
+            {
+                const Pixel * block = image + offset(row, col);
+                int c = col - colStart;
+                
+                top[c] = block[0];
+                if(bottom) bottom[c] = block[2];
+                if(col + 1 == colEnd) break;
+                
+                top[c + 1] = block[1];
+                if(bottom) bottom[c + 1] = block[3];
+            }
+        }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* RAII wrapper around a file mapped into memory with mmap. 
+* 
+* The first constructor maps an existing file read only. The second one creates (or truncates) the file, 
+* sizes it and maps it for reading and writing. Errors are reported with std::runtime_error.
+* ---------------------------------------------------------------
+*/
+class mappedFile
+{
+    private:
+        int m_fd;
+        char * m_data;
+        size_t m_size;
+
+        void map(int protection)
+        {
+            void * address = mmap(nullptr, m_size, protection, MAP_SHARED, m_fd, 0);
+            if(address == MAP_FAILED)
+            {
+                close(m_fd);
+                throw std::runtime_error("cannot map file into memory");
+            }
+            m_data = static_cast<char *>(address);
+        }
+
+    public:
+    /**
+        Constructor, maps an existing file read only
+        */
+        explicit mappedFile(const std::string & path): m_fd(-1), m_data(nullptr), m_size(0)
+        {
+            m_fd = open(path.c_str(), O_RDONLY);
+            if(m_fd < 0) throw std::runtime_error("cannot open " + path);
+
+            struct stat info;
+            if(fstat(m_fd, &info) != 0 || info.st_size == 0)
+            {
+                close(m_fd);
+                throw std::runtime_error("cannot map empty file " + path);
+            }
+
+            m_size = static_cast<size_t>(info.st_size);
+            map(PROT_READ);
+        }
+
+    /**
+        Constructor, creates a file of size bytes and maps it for writing
+        */
+        mappedFile(const std::string & path, size_t size): m_fd(-1), m_data(nullptr), m_size(size)
+        {
+            m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(m_fd < 0) throw std::runtime_error("cannot create " + path);
+
+            if(ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+            {
+                close(m_fd);
+                throw std::runtime_error("cannot resize " + path);
+            }
+
+            map(PROT_READ | PROT_WRITE);
+        }
+
+        mappedFile(const mappedFile &) = delete;
+        mappedFile & operator=(const mappedFile &) = delete;
+
+        char * data() { return m_data; }
+
+        size_t size() const { return m_size; }
+
+        ~mappedFile()
+        {
+            munmap(m_data, m_size);
+            close(m_fd);
+        }
+};
+
+
+//Magic bytes at the start of every pyramid container
+#define PYRAMID_MAGIC "DSPYRMD2"
+
+//Every section of a pyramid container starts on a page boundary, so a reader can mmap any single level
+#define PYRAMID_ALIGNMENT 4096
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Fixed size header at offset 0 of a pyramid container, followed by levelCount pyramidLevelEntry records. 
+* All fields are in the byte order of the machine that wrote the file.
+*
+* magic - PYRAMID_MAGIC
+* elementSize - bytes per element of the base image and the levels, 1, 2 or 4
+* rows, cols - dimensions of the base image
+* levelCount - number of downsampled levels
+* policy - edgePolicy the levels were made with
+* reserved - zero
+* baseOffset - byte offset of the row-major base image
+* ---------------------------------------------------------------
+*/
+struct pyramidFileHeader
+{
+    char magic[8];
+    uint32_t elementSize;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t levelCount;
+    uint32_t policy;
+    uint32_t reserved;
+    uint64_t baseOffset;
+};
+
+//Position of one level in a pyramid container. The level holds rows*cols row-major modes starting at offset.
+struct pyramidLevelEntry
+{
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t offset;
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* A binary container holding a base image and all of its mode-downsampled levels, accessed through mmap. 
+* 
+* Layout: pyramidFileHeader, the table of pyramidLevelEntry records, then the base image and every level, 
+* each section starting on a PYRAMID_ALIGNMENT boundary. Level l (0 based) is the base image downsampled by 2^(l+1), 
+* with the sizes of odd levels rounded as the recorded edgePolicy does.
+*
+* Opening an existing container maps it read only, so the base image can be downsampled in place without a copy.
+* Creating one lays out all sections up front, the caller then fills the base image and the levels through the mapping.
+* ---------------------------------------------------------------
+*/
+class pyramidFile
+{
+    private:
+        std::unique_ptr<mappedFile> m_map;
+        pyramidFileHeader * m_header;
+        pyramidLevelEntry * m_levels;
+
+        static uint64_t alignSection(uint64_t offset)
+        {
+            return (offset + PYRAMID_ALIGNMENT - 1) / PYRAMID_ALIGNMENT * PYRAMID_ALIGNMENT;
+        }
+
+        //True when a section of rows x cols elements starting at offset lies inside a mapping of mapSize bytes. 
+        //Dimensions have to fit an int, and the checks are ordered so that no product or sum can overflow.
+        static bool sectionFits(uint64_t offset, uint32_t rows, uint32_t cols, uint32_t elementSize, uint64_t mapSize)
+        {
+            const uint32_t largest = static_cast<uint32_t>(std::numeric_limits<int>::max());
+            if(rows > largest || cols > largest || offset > mapSize) return false;
+
+            uint64_t elements = static_cast<uint64_t>(rows) * cols;
+            return elements <= (mapSize - offset) / elementSize;
+        }
+
+    public:
+    /**
+        Constructor, opens an existing container read only. Throws std::runtime_error if the file is not a valid container.
+        */
+        explicit pyramidFile(const std::string & path): m_map(new mappedFile(path)), m_header(nullptr), m_levels(nullptr)
+        {
+            if(m_map->size() < sizeof(pyramidFileHeader) || !std::equal(m_map->data(), m_map->data() + 8, PYRAMID_MAGIC))
+                throw std::runtime_error(path + " is not a pyramid container");
+
+            m_header = reinterpret_cast<pyramidFileHeader *>(m_map->data());
+            m_levels = reinterpret_cast<pyramidLevelEntry *>(m_map->data() + sizeof(pyramidFileHeader));
+
+            uint32_t elementSize = m_header->elementSize;
+            if(elementSize != 1 && elementSize != 2 && elementSize != 4)
+                throw std::runtime_error(path + " has an unsupported element size");
+            if(m_header->policy > ignoreEdge)
+                throw std::runtime_error(path + " has an unsupported edge policy");
+
+            //The level table is checked before it is read, then every section has to lie inside the mapping
+            if(m_header->levelCount > (m_map->size() - sizeof(pyramidFileHeader)) / sizeof(pyramidLevelEntry))
+                throw std::runtime_error(path + " is truncated");
+            if(!sectionFits(m_header->baseOffset, m_header->rows, m_header->cols, elementSize, m_map->size()))
+                throw std::runtime_error(path + " is truncated");
+            for(uint32_t level = 0; level < m_header->levelCount; ++level)
+            {
+                if(!sectionFits(m_levels[level].offset, m_levels[level].rows, m_levels[level].cols, elementSize, m_map->size()))
+                    throw std::runtime_error(path + " is truncated");
+            }
+        }
+
+    /**
+        Constructor, creates a container for a rows x cols base image of elementSize byte elements with all of its levels, 
+        sized for the given edge policy. The base image and the levels are zero until they are written.
+        */
+        pyramidFile(const std::string & path, int rows, int cols, int elementSize = sizeof(unsigned int), edgePolicy policy = partialBlocks): m_header(nullptr), m_levels(nullptr)
+        {
+            int levelCount = pyramidLevelCount(rows, cols, policy);
+
+            std::vector<pyramidLevelEntry> levels(levelCount);
+            uint64_t baseOffset = alignSection(sizeof(pyramidFileHeader) + levelCount * sizeof(pyramidLevelEntry));
+            uint64_t end = baseOffset + static_cast<uint64_t>(rows) * cols * elementSize;
+
+            for(int level = 0, levelRows = rows, levelCols = cols; level < levelCount; ++level)
+            {
+                levelRows = nextLevelDim(levelRows, policy);
+                levelCols = nextLevelDim(levelCols, policy);
+                levels[level].rows = levelRows;
+                levels[level].cols = levelCols;
+                levels[level].offset = alignSection(end);
+                end = levels[level].offset + static_cast<uint64_t>(levels[level].rows) * levels[level].cols * elementSize;
+            }
+
+            m_map.reset(new mappedFile(path, static_cast<size_t>(end)));
+            m_header = reinterpret_cast<pyramidFileHeader *>(m_map->data());
+            m_levels = reinterpret_cast<pyramidLevelEntry *>(m_map->data() + sizeof(pyramidFileHeader));
+
+            std::copy(PYRAMID_MAGIC, PYRAMID_MAGIC + 8, m_header->magic);
+            m_header->elementSize = elementSize;
+            m_header->rows = rows;
+            m_header->cols = cols;
+            m_header->levelCount = levelCount;
+            m_header->policy = policy;
+            m_header->baseOffset = baseOffset;
+            std::copy(levels.begin(), levels.end(), m_levels);
+        }
+
+        //True if the file at path starts with PYRAMID_MAGIC
+        static bool isPyramidFile(const std::string & path)
+        {
+            std::ifstream file(path.c_str(), std::ios::binary);
+            char magic[8] = { 0 };
+            file.read(magic, 8);
+            return file && std::equal(magic, magic + 8, PYRAMID_MAGIC);
+        }
+
+        int getRows() const { return m_header->rows; }
+
+        int getCols() const { return m_header->cols; }
+
+        int getLevelCount() const { return m_header->levelCount; }
+
+        edgePolicy getEdgePolicy() const { return static_cast<edgePolicy>(m_header->policy); }
+
+        int getLevelRows(int level) const { return m_levels[level].rows; }
+
+        int getLevelCols(int level) const { return m_levels[level].cols; }
+
+        //Bytes per element of the base image and the levels
+        int getElementSize() const { return m_header->elementSize; }
+
+        //Base image, writable only for containers created by this process. Pixel has to be getElementSize() bytes wide.
+        template <typename Pixel>
+        Pixel * getBaseImage() 
+        { 
+            assert(sizeof(Pixel) == m_header->elementSize);
+            return reinterpret_cast<Pixel *>(m_map->data() + m_header->baseOffset); 
+        }
+
+        //Modes of a level, writable only for containers created by this process. Pixel has to be getElementSize() bytes wide.
+        template <typename Pixel>
+        Pixel * getLevel(int level) 
+        { 
+            assert(sizeof(Pixel) == m_header->elementSize);
+            return reinterpret_cast<Pixel *>(m_map->data() + m_levels[level].offset); 
+        }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* The modes of every level of one image, as returned by downsampleBatch(). 
+* Level l has rows[l] x cols[l] modes, stored row-major in modes[l].
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+struct pyramidModes
+{
+    std::vector<int> rows, cols;
+    std::vector< std::vector<Pixel> > modes;
+
+    //Sets the number of levels, keeping the storage of the levels that remain
+    void resize(int levels)
+    {
+        rows.resize(levels);
+        cols.resize(levels);
+        modes.resize(levels);
+    }
+
+    //Copies the modes of a level, or the values reduction reduces its cells to
+    template <typename Count, typename Reduction = modeReduction<Pixel, Count> >
+    void setLevel(int level, pyramidLevel<Pixel, Count> & cells, const Reduction & reduction = Reduction())
+    {
+        rows[level] = cells.getRows();
+        cols[level] = cells.getCols();
+        modes[level].resize(cells.size());
+        for(size_t i = 0; i < cells.size(); ++i) modes[level][i] = reduction(cells.cell(i));
+    }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* One changed element of a base image, passed to twoDArray::updatePixels().
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+struct pixelUpdate
+{
+    int row, col;
+    Pixel value;
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* This class manages the information for an entire 2D Array of data. 
+* Pixel is the element type (8, 16 or 32 bit unsigned) and Count the type modeMap objects count occurences in. 
+* The way histograms are merged is picked for Pixel at compile time by histogramStrategy.
+* 
+* Member variables are described as below.
+*
+* dimA - Number of Rows
+* dimB - Number of Cols
+* m_levelCount - number of downsampled levels, both axes are halved until they reach 1
+* m_policy - edgePolicy for the last row and col of the image and of every level when there is an odd number of them
+* m_topK - 0 for exact modes, otherwise the downsampled levels keep a misraGriesSummary of at most m_topK values per cell, see setTopK()
+* m_pool - workers reduceGlobalMap() splits large levels over in row bands, or null to reduce them on the calling thread
+* m_fusedLevels - number of levels above level 0 every tile of startThreading() builds for its own part of the image, see setFusedLevels()
+* m_numCols - number of Cols of 2X2 blocks 
+* m_depth -  the number of recursive calls to startThreading happened befoe the object was createad.
+* m_arena - pyramidArena holding every level in one region, laid out by the constructor. It belongs to the caller or to m_ownedArena.
+             Level 0 is a contiguous pyramidLevel with one modeMap per 2x2 block of the enitre baseImage. Every 
+             thread started by startThreading writes the blocks it reads straight into their own slots, so no locking or merging is needed.
+* m_levelsBuilt - number of levels filled so far. Every call to reduceGlobalMap() fills the next downsampled level in place.
+* m_baseImage is a 2 dimensional boost Multi Array
+* m_pixels - the elements that are downsampled. They are either m_baseImage or memory owned by the caller, such as a mapped pyramidFile, 
+*            both row-major, or m_mortonImage.
+* m_baseRead - true once every 2x2 block of level 0 has been read, by startThreading() or lazily by completeFirstLevel()
+* m_lazyTiles - for every level, which LAZY_TILE x LAZY_TILE tiles of cells getRegion() has computed so far. Empty for levels it hasn't touched.
+* m_lazyDepth - number of levels getRegion() has computed cells in
+* m_queryLock - serializes the cells getRegion() computes, reads of built levels don't take it
+* m_morton - true once useMortonLayout() has copied the baseImage into m_mortonImage, laid out by m_zorder
+
+For Example,
+
+Given a baseImage of size, 8x8 the image is split into 4 quadrants and each quadrant into 4 more untill there are TILES_PER_THREAD tiles for every thread of the pool.
+
+3 4 0 6 | 6 4 3 1
+1 4 4 4 | 0 1 4 0
+6 1 4 3 | 7 0 4 3
+4 5 2 2 | 1 4 7 4
+--------------------
+7 5 8 4 | 1 2 4 0
+4 8 4 4 | 1 7 3 7
+8 7 8 4 | 7 3 8 2
+6 8 2 7 | 1 1 1 8
+
+Level 0 would have all the 16 maps corresponding to the 16 2x2 blocks in the base image. The index for each 2X2 block is its zero based row-major position,
+(rowStart/2)*(number of block cols) + (colStart/2), as named in the following convention 
+
+00 01 | 02 03
+04 05 | 06 07
+-----------------
+08 09 | 10 11
+12 13 | 14 15
+
+Once we have the data for a 2x2 block, we can further derive the downsampled image by grouping these 2x2 blocks together. 
  
-                modeMap result;
+* ---------------------------------------------------------------
+*/
+
+template <typename Pixel = unsigned int, typename Count = unsigned int>
+class twoDArray
+{
+        public:
+            typedef boost::multi_array< Pixel, 2> imageArray;
+            typedef pyramidLevel<Pixel, Count> levelType;
+            typedef pyramidArena<Pixel, Count> arenaType;
+            typedef modeMap<Pixel, Count> cellType;
+            
+
+        private:
+            int m_dimA, m_dimB, m_levelCount, m_depth;
+            
+            edgePolicy m_policy;
+            size_t m_topK;
+            workStealingPool * m_pool;
+            int m_fusedLevels;
+            
+            int m_downRows, m_downCols;
+            
+            std::unique_ptr<arenaType> m_ownedArena;
+            arenaType * m_arena;
+            size_t m_levelsBuilt;
+            
+            imageArray m_baseImage;
+            const Pixel * m_pixels;
+            
+            bool m_baseRead;
+            std::vector< std::vector<char> > m_lazyTiles;
+            size_t m_lazyDepth;
+            std::mutex m_queryLock;
+            
+            bool m_morton;
+            mortonLayout m_zorder;
+            std::vector<Pixel> m_mortonImage;
+            
+            //Finds m_levelCount and m_depth and lays out the levels in the arena, owning one if the caller gave none. Called by the constructors.
+            void setupLevels(arenaType * arena)
+            {
+                checkCountFits<Count>({m_dimA, m_dimB}, m_policy);
+                m_levelCount = pyramidLevelCount(m_dimA, m_dimB, m_policy);
+                m_depth = m_levelCount;
+                
+                if(!arena)
+                {
+                    m_ownedArena.reset(new arenaType());
+                    arena = m_ownedArena.get();
+                }
+                m_arena = arena;
+                m_arena->prepare(m_dimA, m_dimB, m_policy);
+                
+                //Level 0 has one slot per block, filled in by the threads started from startThreading
+                m_levelsBuilt = 1;
+            }
+            
+            //True when every cell of a level has been built, level 0 by startThreading() or completeFirstLevel() and the others by reduceGlobalMap()
+            bool levelReady(int level) const
+            {
+                return m_baseRead && static_cast<size_t>(level) < m_levelsBuilt;
+            }
+            
+            //True when a cell has been computed, either with its whole level or by getRegion()
+            bool cellReady(int level, int row, int col) const
+            {
+                if(levelReady(level)) return true;
+                if(static_cast<size_t>(level) >= m_lazyTiles.size() || m_lazyTiles[level].empty()) return false;
+                
+                int tileCols = (m_arena->getLevel(level).getCols() + LAZY_TILE - 1) / LAZY_TILE;
+                return m_lazyTiles[level][(row / LAZY_TILE) * tileCols + col / LAZY_TILE] != 0;
+            }
+            
+            /**
+            
+            Computes the cells of rows [rowStart, rowEnd) x cols [colStart, colEnd) of a level that haven't been computed yet, 
+            a LAZY_TILE x LAZY_TILE tile at a time. Level 0 is read from the baseImage, other levels are reduced from the tiles 
+            of the level below them, which are computed first if need be. Every tile is remembered in m_lazyTiles.
+             
+             @param 
+                    level - the level
+                    rowStart, rowEnd, colStart, colEnd - the cells needed, inside the level
+             @return 
+                    void           
+            */
+            void computeRegion(int level, int rowStart, int rowEnd, int colStart, int colEnd)
+            {
+                if(levelReady(level) || rowStart >= rowEnd || colStart >= colEnd) return;
+                
+                levelType & cells = m_arena->getLevel(level);
+                int tileRows = (cells.getRows() + LAZY_TILE - 1) / LAZY_TILE, tileCols = (cells.getCols() + LAZY_TILE - 1) / LAZY_TILE;
+                if(m_lazyTiles.size() < static_cast<size_t>(m_levelCount)) m_lazyTiles.resize(m_levelCount);
+                if(m_lazyTiles[level].empty()) m_lazyTiles[level].assign(static_cast<size_t>(tileRows) * tileCols, 0);
+                m_lazyDepth = std::max(m_lazyDepth, static_cast<size_t>(level) + 1);
+                
+                for(int tileRow = rowStart / LAZY_TILE; tileRow <= (rowEnd - 1) / LAZY_TILE; ++tileRow)
+                {
+                    for(int tileCol = colStart / LAZY_TILE; tileCol <= (colEnd - 1) / LAZY_TILE; ++tileCol)
+                    {
+                        char & done = m_lazyTiles[level][static_cast<size_t>(tileRow) * tileCols + tileCol];
+                        if(done) continue;
+                        
+                        int r0 = tileRow * LAZY_TILE, r1 = std::min(cells.getRows(), r0 + LAZY_TILE);
+                        int c0 = tileCol * LAZY_TILE, c1 = std::min(cells.getCols(), c0 + LAZY_TILE);
+                        
+                        if(level == 0)
+                        {
+                            if(!m_pixels) throw std::runtime_error("the base image has been freed by mergeAllMaps()");
+                            for(int r = r0; r < r1; ++r) findRowModes(2 * r, std::min(2 * r + 2, m_dimA), 2 * c0, std::min(2 * c1, m_dimB), 0, 0);
+                        }
+                        else
+                        {
+                            levelType & finer = m_arena->getLevel(level - 1);
+                            computeRegion(level - 1, 2 * r0, std::min(2 * r1, finer.getRows()), 2 * c0, std::min(2 * c1, finer.getCols()));
+                            finer.reduceRegion(cells, m_policy, m_topK, r0, r1, c0, c1);
+                        }
+                        done = 1;
+                    }
+                }
+            }
+            
+            //Computes what getRegion() left out of level 0, when startThreading() hasn't read it. Level 0 is then ready, 
+            //so the levels reduceGlobalMap() builds on it are ready too and updates reach them.
+            void completeFirstLevel()
+            {
+                if(m_baseRead) return;
+                if(m_levelCount > 0) computeRegion(0, 0, m_arena->getLevel(0).getRows(), 0, m_arena->getLevel(0).getCols());
+                m_baseRead = true;
+            }
+            
+            //Levels built by the tiles themselves, no more than the image has
+            int fusedLevelCount() const
+            {
+                return std::max(0, std::min(m_fusedLevels, m_levelCount - 1));
+            }
+            
+            //Maps [start, end) of an axis of the given size to the cells of the next level they make up, 
+            //the end of the axis taking the last cell with it. size becomes the size of the next level.
+            void shrinkRange(int & start, int & end, int & size) const
+            {
+                start /= 2;
+                end = (end == size) ? nextLevelDim(size, m_policy) : end / 2;
+                size = nextLevelDim(size, m_policy);
+            }
+            
+            //Throws when reduction reads whole histograms and the levels only keep summaries, see setTopK()
+            template <typename Reduction>
+            void checkReduction(const Reduction &) const
+            {
+                if(Reduction::exactCounts && m_topK > 0) 
+                    throw std::runtime_error(std::string("the ") + Reduction::name() + " reduction needs exact levels, it can't be used with a top-k");
+            }
+            
+            //Finds the row or col of the next level that row or col index of an axis of the given size is grouped into, and how many 
+            //times it is counted there. Returns false when the last row or col is dropped by ignoreEdge.
+            bool parentCell(int index, int size, int & parent, Count & weight) const
+            {
+                parent = index / 2;
+                weight = (axisPolicy(m_policy, size) == replicateEdge && size % 2 == 1 && index == size - 1) ? 2 : 1;
+                return parent < nextLevelDim(size, m_policy);
+            }
+            
+            //Makes the baseImage writable, copying it out of memory owned by the caller the first time. Throws once mergeAllMaps() has freed it, 
+            //or when approximate levels have been built, as their counts can't be moved from one value to another.
+            Pixel * writablePixels()
+            {
+                if(!m_pixels) throw std::runtime_error("the base image has been freed by mergeAllMaps()");
+                if(m_topK > 0 && std::max(m_levelsBuilt, m_lazyDepth) > 1) throw std::runtime_error("levels built with an approximate mode can't be updated");
+                if(m_morton) return m_mortonImage.data();
+                
+                if(m_pixels != m_baseImage.data())
+                {
+                    m_baseImage.resize(extents[m_dimA][m_dimB]);
+                    std::copy(m_pixels, m_pixels + static_cast<size_t>(m_dimA) * m_dimB, m_baseImage.data());
+                    instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(m_dimA) * m_dimB * sizeof(Pixel));
+                    m_pixels = m_baseImage.data();
+                }
+                
+                return m_baseImage.data();
+            }
+            
+            /**
+            
+            Changes one element of the baseImage and moves its count from the old value to the new one in every cell of the 
+            levels built so far that it is grouped into. The modes are left for refreshModes().
+             
+             @param 
+                    pixels - writable baseImage
+                    row, col - position of the element
+                    value - new value of the element
+                    dirty - receives the row-major index of every cell changed, one list per level
+             @return 
+                    void           
+            */
+            void applyUpdate(Pixel * pixels, int row, int col, Pixel value, std::vector< std::vector<size_t> > & dirty)
+            {
+                if(row < 0 || row >= m_dimA || col < 0 || col >= m_dimB) throw std::runtime_error("update outside the image");
+                
+                Pixel & element = pixels[m_morton ? m_zorder.offset(row, col) : static_cast<size_t>(row) * m_dimB + col];
+                Pixel old = element;
+                if(old == value) return;
+                element = value;
+                
+                int rows = m_dimA, cols = m_dimB;
+                Count weight = 1;
+                
+                for(int level = 0; level < m_levelCount; ++level)
+                {
+                    int parentRow, parentCol;
+                    Count rowWeight, colWeight;
+                    if(!parentCell(row, rows, parentRow, rowWeight) || !parentCell(col, cols, parentCol, colWeight)) return;
+                    
+                    //Cells that haven't been computed yet will be made from the updated ones
+                    if(!cellReady(level, parentRow, parentCol)) return;
+                    
+                    row = parentRow;
+                    col = parentCol;
+                    rows = m_arena->getLevel(level).getRows();
+                    cols = m_arena->getLevel(level).getCols();
+                    weight *= rowWeight * colWeight;
+                    
+                    cellType & cell = m_arena->getLevel(level).at(row, col);
+                    cell.removeElement(old, weight);
+                    cell.addElement(value, weight);
+                    dirty[level].push_back(static_cast<size_t>(row) * cols + col);
+                }
+            }
+            
+            //Recalculates the mode of every cell applyUpdate() changed, once per cell.
+            void refreshModes(std::vector< std::vector<size_t> > & dirty)
+            {
+                for(size_t level = 0; level < dirty.size(); ++level)
+                {
+                    std::vector<size_t> & cells = dirty[level];
+                    std::sort(cells.begin(), cells.end());
+                    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+                    
+                    for(size_t i = 0; i < cells.size(); ++i) m_arena->getLevel(level).cell(cells[i]).calculateMode();
+                }
+            }
+            
+            public:
+            
+            /**
+            
+            Constructor for the class. Initializes all member variables and also fills the matrix with random values from 1-8. 
+            The dimensions can be any size, policy decides how blocks at an odd last row or col are handled. 
+            The levels are stored in arena when one is given, it can be reused by the next image once this one is destroyed.
+              
+            */
+            twoDArray(int dimA, int dimB, edgePolicy policy = partialBlocks, arenaType * arena = nullptr) : m_dimA(checkedDim(dimA)), m_dimB(checkedDim(dimB)), m_levelCount(0), m_depth(0), m_policy(policy), m_topK(0), m_pool(nullptr), m_fusedLevels(0), m_downRows(nextLevelDim(dimA, policy)), m_downCols(nextLevelDim(dimB, policy)), m_baseImage(boost::extents[m_dimA][m_dimB]), m_baseRead(false), m_lazyDepth(0), m_morton(false)
+
+            {
+                for(index i = 0; i < m_dimA; ++i)
+                {
+                    for(index j = 0; j < m_dimB; ++j)
+                    {
+                        m_baseImage[i][j] = static_cast<Pixel>(rand()%9);
+                        
+                        //uncommment the below TWO statements to see the original matrix
+                        //std::cout << m_baseImage[i][j] << " ";
+                    }
+                    //std::cout << std::endl;
+                }
+                
+                m_pixels = m_baseImage.data();
+                setupLevels(arena);
+            }
+            
+            /**
+            
+            Constructor for an image whose elements are already in memory, for example the base image of a mapped pyramidFile. 
+            The elements are read in place and must stay valid until mergeAllMaps() is called.
+              
+            */
+            twoDArray(const Pixel * pixels, int dimA, int dimB, edgePolicy policy = partialBlocks, arenaType * arena = nullptr) : m_dimA(checkedDim(dimA)), m_dimB(checkedDim(dimB)), m_levelCount(0), m_depth(0), m_policy(policy), m_topK(0), m_pool(nullptr), m_fusedLevels(0), m_downRows(nextLevelDim(dimA, policy)), m_downCols(nextLevelDim(dimB, policy)), m_baseImage(boost::extents[0][0]), m_pixels(pixels), m_baseRead(false), m_lazyDepth(0), m_morton(false)
+
+            {
+                setupLevels(arena);
+            }
+            
+            /**
+            
+            Function to create a modeMap object for every 2x2 block of a pair of rows. The modes and counts of the whole row pair are found at once by the row pair kernel, 
+            then the four elements of each block are added to its slot in level 0 along with the depth and threadNumber. 
+            A lone last row or col of the image is handled by buildBlockRow() according to m_policy.
+             
+             @param 
+                    rowStart, rowEnd - the one or two rows in the baseImage 
+                    colStart, colEnd - col positions of the elements in the baseImage.
+                    depth - Depth of the cube in the baseImage 
+                    threadNumber - thread reading a particular 2x2 block in the baseImage.
+
+             @return 
+                    void           
+            */
+            
+            void findRowModes(int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber)
+            {
+                const Pixel * top = m_pixels + static_cast<size_t>(rowStart) * m_dimB;
+                const Pixel * bottom = top + m_dimB;
+                edgePolicy rowPolicy = axisPolicy(m_policy, m_dimA), colPolicy = axisPolicy(m_policy, m_dimB);
+                
+                if(rowEnd - rowStart == 1)
+                {
+                    if(rowPolicy == ignoreEdge) return;
+                    bottom = (rowPolicy == replicateEdge) ? top : nullptr;
+                }
+                
+                //Every block has its own slot, so threads never write to the same modeMap
+                int index = (rowStart/2)*m_arena->getLevel(0).getCols() + (colStart/2);
+                cellType * result = &m_arena->getLevel(0).cell(index);
+                int width = colEnd - colStart;
+                int blocks = (colPolicy == ignoreEdge) ? width/2 : (width + 1)/2;
+                
+                if(!m_morton) buildBlockRow(top + colStart, bottom ? bottom + colStart : nullptr, width, colPolicy, result);
+                else
+                {
+                    //The blocks of a Z-order image are copied out a tile width at a time, so the row pair kernels can read them as rows
+                    Pixel topRow[MORTON_TILE], bottomRow[MORTON_TILE];
+                    bool pair = (rowEnd - rowStart == 2);
+                    
+                    for(int chunk = colStart; chunk < colEnd; chunk += MORTON_TILE)
+                    {
+                        int chunkEnd = std::min(colEnd, chunk + MORTON_TILE);
+                        m_zorder.readRowPair(m_pixels, rowStart, chunk, chunkEnd, topRow, pair ? bottomRow : nullptr);
+                        buildBlockRow(topRow, pair ? bottomRow : (bottom ? topRow : nullptr), chunkEnd - chunk, colPolicy, result + (chunk - colStart)/2);
+                    }
+                }
+                instrumentation::add(&threadCounters::blocks, blocks);
+                
+                for(int b = 0; b < blocks; ++b)
+                {
+                    result[b].setDepth(depth);
+                    result[b].setthreadNumber(threadNumber);	
+                }
+            }            
+            
+              /**
+            
+            Recursive function to split a sub matrix into pairs of rows, whose 2x2 blocks are then used to compute downsampled images.            
+             
+             @param 
+                    rowStart, rowEnd - row positions of the elements in the baseImage 
+                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
+                    depth - Depth of the cube in the baseImage 
+                    threadNumber - thread reading a particular 2x2 block in the baseImage.
+
+             @return 
+                    void           
+            */
+            
+            void divideCube(int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber)
+            {
+                //A Z-order image is also split along the cols, down to its tiles, so the row pairs of a tile are read while it is in cache
+                if(m_morton && (colEnd-colStart) > MORTON_TILE)
+                {
+                    int colMid = alignedMidpoint(colStart, colEnd, MORTON_TILE);
+                    divideCube(rowStart, rowEnd, colStart, colMid, depth, threadNumber);
+                    divideCube(rowStart, rowEnd, colMid, colEnd, depth, threadNumber);
+                    return;
+                }
+
+                if((rowEnd-rowStart) <= 2)
+                {	
+                    findRowModes(rowStart, rowEnd, colStart, colEnd, depth, threadNumber);
+                    return;
+                } 
+
+                int rowMid = evenMidpoint(rowStart, rowEnd);
+
+                divideCube( rowStart, rowMid, colStart, colEnd, depth, threadNumber);
+
+                divideCube( rowMid, rowEnd, colStart, colEnd, depth, threadNumber);
+
+                return;
+            }
+            
+            /**
+            
+            Shortcut for a tile of the baseImage holding a single value, common in the background of label rasters. 
+            The tile is scanned until the first element that differs, and when there is none every 2x2 block of the tile is set 
+            to the value with a count of 4 directly, with no row pair kernel and no histogram per element. 
+            The levels the tile groups into are then uniform too and reduceRowPair() sets them without merging.
+            Tiles with a lone last row or col, and Z-order images, are left to divideCube().
+             
+             @param 
+                    rowStart, rowEnd - row positions of the elements in the baseImage 
+                    colStart, colEnd - col positions of the elements in the baseImage
+                    depth - Depth of the cube in the baseImage 
+                    threadNumber - thread reading the tile
+             @return 
+                    true if the tile was uniform and its blocks have been set           
+            */
+            bool fillUniformTile(int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber)
+            {
+                if(m_morton || rowStart >= rowEnd || colStart >= colEnd || (rowEnd - rowStart) % 2 || (colEnd - colStart) % 2) return false;
+                
+                const Pixel value = m_pixels[static_cast<size_t>(rowStart) * m_dimB + colStart];
+                for(int r = rowStart; r < rowEnd; ++r)
+                {
+                    const Pixel * row = m_pixels + static_cast<size_t>(r) * m_dimB;
+                    if(std::find_if(row + colStart, row + colEnd, [value](Pixel element) { return element != value; }) != row + colEnd) return false;
+                }
+                
+                levelType & blocks = m_arena->getLevel(0);
+                for(int r = rowStart / 2; r < rowEnd / 2; ++r)
+                {
+                    cellType * cells = blocks.row(r);
+                    for(int c = colStart / 2; c < colEnd / 2; ++c)
+                    {
+                        cells[c].addElement(value, 4);
+                        cells[c].setMode(value, 4);
+                        cells[c].setDepth(depth);
+                        cells[c].setthreadNumber(threadNumber);
+                    }
+                }
+                
+                uint64_t count = static_cast<uint64_t>(rowEnd - rowStart) * (colEnd - colStart) / 4;
+                instrumentation::add(&threadCounters::blocks, count);
+                instrumentation::add(&threadCounters::uniformCells, count);
+                return true;
+            }
+            
+             /**
+            
+            Function to call once startThreading() has returned. Every 2x2 block is already in its slot of level 0, so all that is left 
+            is to free the memory of the baseImage. Skip it to keep the image open to updatePixels() and updateRegion().
+             
+             @param 
+                    void  
+             @return 
+                    void           
+            */
+            
+            void mergeAllMaps()
+            {    
+                //Free the memory allocated for the image since we now have all the data in the levels
+                m_baseImage.resize(extents[0][0]);
+                std::vector<Pixel>().swap(m_mortonImage);
+                m_pixels = nullptr;
+                
+                return;
+            }
+            
+            /**
+            
+            Function to change a set of elements of the baseImage after the pyramid has been built, without building it again. 
+            Only the cells the elements are grouped into are touched: the old value is taken out of their histograms, 
+            the new one added, and their modes are recalculated. The cost is proportional to the number of updates times the number of levels. 
+            Levels that have not been built yet are made from the updated ones by reduceGlobalMap() as usual.
+            The baseImage must not have been freed by mergeAllMaps().
+             
+             @param 
+                    updates - the elements to change, later updates of the same element win
+             @return 
+                    void           
+            */
+            void updatePixels(const std::vector< pixelUpdate<Pixel> > & updates)
+            {
+                Pixel * pixels = writablePixels();
+                std::vector< std::vector<size_t> > dirty(m_levelCount);
+                
+                for(size_t i = 0; i < updates.size(); ++i) applyUpdate(pixels, updates[i].row, updates[i].col, updates[i].value, dirty);
+                
+                refreshModes(dirty);
+            }
+            
+            /**
+            
+            Function to overwrite a rectangle of the baseImage after the pyramid has been built, the same way updatePixels() does.
+             
+             @param 
+                    rowStart, colStart - top left element of the rectangle
+                    rows, cols - size of the rectangle
+                    values - rows*cols new elements in row-major order
+             @return 
+                    void           
+            */
+            void updateRegion(int rowStart, int colStart, int rows, int cols, const Pixel * values)
+            {
+                Pixel * pixels = writablePixels();
+                std::vector< std::vector<size_t> > dirty(m_levelCount);
+                
+                for(int r = 0; r < rows; ++r)
+                {
+                    for(int c = 0; c < cols; ++c) applyUpdate(pixels, rowStart + r, colStart + c, values[static_cast<size_t>(r) * cols + c], dirty);
+                }
+                
+                refreshModes(dirty);
+            }
+            
+            /**
+            
+            Function to trade exact modes for bounded memory on images with many distinct values. Levels built afterwards by reduceGlobalMap() 
+            keep at most topK values per cell, the ones counted most often. A value occurring more than n/(topK+1) times among the n elements 
+            of a cell is always kept, and the mode is found exactly whenever it does, which is the case for any image with few distinct values.
+            Level 0 stays exact, and updatePixels() can't be used once approximate levels have been built.
+             
+             @param 
+                    topK - values kept per cell, 0 for exact modes
+             @return 
+                    void           
+            */
+            void setTopK(size_t topK)
+            {
+                m_topK = topK;
+            }
+            
+            /**
+            
+            Function to let reduceGlobalMap() use a pool. Levels with enough cells are then split into row bands reduced concurrently, 
+            which matters once the base image is read in parallel, as the first levels are nearly as large as the base pass.
+             
+             @param 
+                    pool - workers to reduce levels on, null to reduce them on the calling thread
+             @return 
+                    void           
+            */
+            void setPool(workStealingPool * pool)
+            {
+                m_pool = pool;
+            }
+            
+            /**
+            
+            Function to have every tile of startThreading() build levels 1 to levels for its own part of the image while it is still in cache, 
+            instead of waiting for reduceGlobalMap() to go over each whole level. The tiles are then split on multiples of 2^(levels+1) 
+            elements so that no cell of those levels straddles two tiles. Once startThreading() returns, those levels are built 
+            and reduceGlobalMap() carries on from the next one.
+             
+             @param 
+                    levels - number of levels above level 0 built by the tiles, 0 to build them all with reduceGlobalMap()
+             @return 
+                    void           
+            */
+            void setFusedLevels(int levels)
+            {
+                m_fusedLevels = std::max(0, levels);
+            }
+            
+            /**
+            
+            Function to copy the baseImage into a Z-order layout, see mortonLayout, before startThreading() reads it. Every 2x2 block is then 
+            four adjacent elements, tiles are split on whole MORTON_TILE x MORTON_TILE tiles and each of those is a contiguous range, 
+            so every tile a thread reads stays in cache however deep the split goes. The row-major copy owned by the object is freed, 
+            memory owned by the caller is left alone. The levels are the same in either layout.
+             
+             @param 
+                    void
+             @return 
+                    void           
+            */
+            void useMortonLayout()
+            {
+                if(m_morton) return;
+                if(!m_pixels) throw std::runtime_error("the base image has been freed by mergeAllMaps()");
+                
+                m_zorder = mortonLayout(m_dimA, m_dimB);
+                m_mortonImage.assign(m_zorder.size(), Pixel(0));
+                m_zorder.fromRowMajor(m_pixels, m_dimA, m_dimB, m_mortonImage.data());
+                instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(m_dimA) * m_dimB * sizeof(Pixel));
+                
+                m_baseImage.resize(extents[0][0]);
+                m_pixels = m_mortonImage.data();
+                m_morton = true;
+            }
+            
+            //Multiple of rows and cols startThreading() splits the image on, so that the levels built by the tiles don't straddle two of them 
+            //and a Z-order image is split on whole tiles
+            int getTileAlignment() const
+            {
+                return std::max(2 << fusedLevelCount(), m_morton ? MORTON_TILE : 2);
+            }
+            
+            /**
+            
+            Function called by a tile of startThreading() once it has read its 2x2 blocks, to build its part of the fused levels.
+             
+             @param 
+                    rowStart, rowEnd - row positions of the tile in the baseImage 
+                    colStart, colEnd - col positions of the tile in the baseImage
+             @return 
+                    void           
+            */
+            void fuseTile(int rowStart, int rowEnd, int colStart, int colEnd)
+            {
+                int rows = m_dimA, cols = m_dimB;
+                shrinkRange(rowStart, rowEnd, rows);
+                shrinkRange(colStart, colEnd, cols);
+                
+                for(int level = 1; level <= fusedLevelCount(); ++level)
+                {
+                    shrinkRange(rowStart, rowEnd, rows);
+                    shrinkRange(colStart, colEnd, cols);
+                    if(rowStart < rowEnd && colStart < colEnd)
+                        m_arena->getLevel(level - 1).reduceRegion(m_arena->getLevel(level), m_policy, m_topK, rowStart, rowEnd, colStart, colEnd);
+                }
+            }
+            
+            //Function called by startThreading() once every tile is done, the levels they built are complete
+            void tilesRead()
+            {
+                m_baseRead = true;
+                if(m_levelsBuilt != 1) return;
+                
+                for(int level = 1; level <= fusedLevelCount(); ++level)
+                {
+                    ++m_levelsBuilt;
+                    m_downCols = nextLevelDim(m_downCols, m_policy);
+                    m_downRows = nextLevelDim(m_downRows, m_policy);
+                }
+            }
+            
+            //Getter function to read the number of levels built so far, level 0 included
+            size_t getLevelsBuilt() const
+            {
+                return m_levelsBuilt;
+            }
+            
+            //Getter function to read the size of the current level. 
+            size_t getGlobalMapSize()
+            {
+                return m_arena->getLevel(static_cast<int>(m_levelsBuilt) - 1).size();
+            }
+            
+            //Getter function to read the number of downsampled levels
+            int getLevelCount()
+            {
+                return m_levelCount;
+            }
+            
+            //Getter function to read depth
+            int getDepth()
+            {
+                return m_depth;
+            }
+            
+            /**
+            
+            Function to print all downsampled versions of a 2D image. This function also calls the reduceGlobalMap() which groups 2x2 blocks from the base image.
+            It runs through a loop and print values from the current level. It also keeps track of rows and colums of the downsampled images
+             
+             @param 
+                    out - stream the levels are printed to, std::cout by default  
+                    reduction - reduction operator giving the value printed for each cell, the mode by default
+             @return 
+                    void           
+            */
+            template <typename Reduction = modeReduction<Pixel, Count> >
+            void printDownsampled(std::ostream & out = std::cout, const Reduction & reduction = Reduction())
+            {
+                checkReduction(reduction);
+                completeFirstLevel();
+                
+                //Outerloop to print the number of downsampled images based on the value of m_levelCount.
+                for(int level = 0; level < m_levelCount; ++level)
+                {
+                    levelType & current = m_arena->getLevel(level);
+                    
+                    //Inner loop to print elements 
+                    for(int r = 0; r < current.getRows(); ++r)
+                    {
+                        cellType * cells = current.row(r);
+
+                        for(int c = 0; c < current.getCols(); ++c)
+                        {
+                            out << static_cast<unsigned long>(reduction(cells[c])) << " " ;
+                        }
+
+                        out << std::endl;
+                    }
+                    
+                    out << std::endl;
+                    
+                    //Reduce the globalMap size after every iteration. This increases the grouping size in the base image and forms new Map objects. 
+                    //Levels built by an earlier call are reused, they are kept up to date by updatePixels() and updateRegion().
+                    if(level + 1 < m_levelCount) 
+                    {
+                        if(m_levelsBuilt == level + 1u) reduceGlobalMap();
+                        out << "The number of cubes is : " << m_arena->getLevel(level + 1).size()  << std::endl;               
+                    }
+                    
+                }
+                
+                 return;
+            }
+            
+            /**
+            
+            Function to write all downsampled versions of a 2D image into a pyramid container, in place of printDownsampled(). 
+            The levels are produced the same way, by calling reduceGlobalMap() after each one has been written.
+             
+             @param 
+                    file - container created for the dimensions of this image  
+                    reduction - reduction operator giving the value written for each cell, the mode by default
+             @return 
+                    void           
+            */
+            template <typename Reduction = modeReduction<Pixel, Count> >
+            void writeDownsampled(pyramidFile & file, const Reduction & reduction = Reduction())
+            {
+                checkReduction(reduction);
+                completeFirstLevel();
+                
+                for(int level = 0; level < file.getLevelCount(); ++level)
+                {
+                    levelType & current = m_arena->getLevel(level);
+                    Pixel * modes = file.template getLevel<Pixel>(level);
+                    
+                    for(size_t i = 0; i < current.size(); ++i) modes[i] = reduction(current.cell(i));
+                    
+                    if(level + 1 < file.getLevelCount() && m_levelsBuilt == level + 1u) reduceGlobalMap();
+                }
+                
+                 return;
+            }
+            
+            
+            /**
+            
+            Function to copy the modes of every level into result, building the levels that are missing with reduceGlobalMap().
+             
+             @param 
+                    result - receives the modes of every level  
+                    reduction - reduction operator giving the value copied for each cell, the mode by default
+             @return 
+                    void           
+            */
+            template <typename Reduction = modeReduction<Pixel, Count> >
+            void copyModes(pyramidModes<Pixel> & result, const Reduction & reduction = Reduction())
+            {
+                checkReduction(reduction);
+                completeFirstLevel();
+                result.resize(m_levelCount);
+                
+                for(int level = 0; level < m_levelCount; ++level)
+                {
+                    if(m_levelsBuilt == static_cast<size_t>(level)) reduceGlobalMap();
+                    result.setLevel(level, m_arena->getLevel(level), reduction);
+                }
+                
+                 return;
+            }
+            
+            
+            /**
+            
+            Function to read part of one level without building the whole pyramid. Only the cells needed are computed: from the baseImage, 
+            or from the nearest finer level that already has them. Whatever is computed is kept, so later queries of the same area, 
+            of coarser levels above it and reduceGlobalMap() reuse it. Levels built by startThreading() and reduceGlobalMap() are read as they are. 
+            Reading level 0 this way takes the place of startThreading(), don't call both. Several threads can query at once: 
+            levels that are already built are read without locking, and only computing missing cells is serialized. 
+            Computed cells don't change again, so they are copied out after the lock is released.
+             
+             @param 
+                    level - the level, 0 being the 2x2 blocks of the baseImage
+                    rowStart, rowEnd - rows of the level to read
+                    colStart, colEnd - cols of the level to read
+                    values - receives the region in row-major order
+                    reduction - reduction operator giving the value of each cell, the mode by default
+             @return 
+                    void           
+            */
+            template <typename Reduction = modeReduction<Pixel, Count> >
+            void getRegion(int level, int rowStart, int rowEnd, int colStart, int colEnd, std::vector<Pixel> & values, const Reduction & reduction = Reduction())
+            {
+                checkReduction(reduction);
+                if(level < 0 || level >= m_levelCount) throw std::runtime_error("no such level");
+                
+                levelType & cells = m_arena->getLevel(level);
+                if(rowStart < 0 || colStart < 0 || rowEnd > cells.getRows() || colEnd > cells.getCols() || rowStart > rowEnd || colStart > colEnd)
+                    throw std::runtime_error("region outside the level");
+                
+                traceScope trace("getRegion", "level", level, "cells", static_cast<long long>(rowEnd - rowStart) * (colEnd - colStart));
+                if(!levelReady(level))
+                {
+                    std::lock_guard<std::mutex> lock(m_queryLock);
+                    computeRegion(level, rowStart, rowEnd, colStart, colEnd);
+                }
+                
+                values.resize(static_cast<size_t>(rowEnd - rowStart) * (colEnd - colStart));
+                for(int r = rowStart; r < rowEnd; ++r)
+                {
+                    for(int c = colStart; c < colEnd; ++c) values[static_cast<size_t>(r - rowStart) * (colEnd - colStart) + (c - colStart)] = reduction(cells.at(r, c));
+                }
+            }
+            
+            //Getter functions to read the dimensions of a level
+            int getLevelRows(int level) { return m_arena->getLevel(level).getRows(); }
+            int getLevelCols(int level) { return m_arena->getLevel(level).getCols(); }
+            
+            //Number of rows of the baseImage
+            int getRows() const { return m_dimA; }
+            
+            //Reads a whole level, see getRegion()
+            template <typename Reduction = modeReduction<Pixel, Count> >
+            void getLevel(int level, std::vector<Pixel> & values, const Reduction & reduction = Reduction())
+            {
+                if(level < 0 || level >= m_levelCount) throw std::runtime_error("no such level");
+                getRegion(level, 0, m_arena->getLevel(level).getRows(), 0, m_arena->getLevel(level).getCols(), values, reduction);
+            }
+            
+            /**
+            
+            Helper funtion for printDownsampled(). Everytime reduceGlobalMap() is called it groups 2x more elements in row and columns of the base image. 
+            Since we are keep track of element counts in individual modeMaps, we need not read the base Image everytime to produce a downsampled image. 
+             
+             
+             From the description of class twoDArray, this is a 1-downsampled 2x2 image where each element is a modeMap object having data about the different elements in the baseImage and their counts.
+             
+             01 02 | 03 04
+             05 06 | 07 08
+             -----------------
+             09 10 | 11 12
+             13 14 | 15 16
+             
+             After downsampling, the new set of modeMap objects look like this 
+             
+             01new | 02new
+             -----------------
+             03new | 04new
+             
+             where,
+
+             01new = group ( 01, 02, 05, 06)
+             02new = group ( 03, 04, 07, 08)
+             03new = group ( 09, 10, 13, 14)
+             04new = group ( 11, 12, 15, 16)
+             
+             And the process continues until both axes are down to 1. When a level has an odd number of rows or cols, 
+             the last group is made according to m_policy.
+             The grouping itself is done by pyramidLevel::reduceInto() on the contiguous level buffers.
+             
+             @param 
+                    void  
+             @return 
+                    void           
+            */
+            
+            void reduceGlobalMap()
+            {
+                int level = static_cast<int>(m_levelsBuilt);
+                traceScope trace("reduceGlobalMap", "level", level, "cells", m_arena->getLevel(level).size());
+                
+                //Form the new level from the one below it, in the slot the arena reserved for it. 
+                //Large levels are split into row bands that are reduced on the pool, each band writes only its own rows.
+                levelType & finer = m_arena->getLevel(level - 1), & coarser = m_arena->getLevel(level);
+                if(level == 1) completeFirstLevel();
+                else computeRegion(level - 1, 0, finer.getRows(), 0, finer.getCols());
+                
+                //A level getRegion() has started is completed tile by tile instead
+                if(static_cast<size_t>(level) < m_lazyTiles.size() && !m_lazyTiles[level].empty())
+                {
+                    computeRegion(level, 0, coarser.getRows(), 0, coarser.getCols());
+                    ++m_levelsBuilt;
+                    m_downCols = nextLevelDim(m_downCols, m_policy);
+                    m_downRows = nextLevelDim(m_downRows, m_policy);
+                    return;
+                }
+                
+                size_t bands = m_pool ? std::min(coarser.size() / REDUCE_BAND_CELLS, std::min<size_t>(coarser.getRows(), m_pool->getThreadCount() * TILES_PER_THREAD)) : 1;
+                
+                if(bands <= 1) finer.reduceInto(coarser, m_policy, m_topK);
+                else
+                {
+                    taskGroup group(*m_pool);
+                    edgePolicy policy = m_policy;
+                    size_t topK = m_topK;
+                    int rows = coarser.getRows(), cols = coarser.getCols();
+                    
+                    for(size_t band = 0; band < bands; ++band)
+                    {
+                        int rowStart = static_cast<int>(rows * band / bands), rowEnd = static_cast<int>(rows * (band + 1) / bands);
+                        levelType * from = &finer, * to = &coarser;
+                        group.run([=]()
+                        {
+                            traceScope trace("band", "rows", rowEnd - rowStart);
+                            from->reduceRegion(*to, policy, topK, rowStart, rowEnd, 0, cols);
+                        }, m_pool->workerForRow(rowStart, rows));
+                    }
+                    group.wait();
+                }
+                ++m_levelsBuilt;
+                
+                //Update member variables accordingly. 
+                m_downCols = nextLevelDim(m_downCols, m_policy);
+                m_downRows = nextLevelDim(m_downRows, m_policy);
                
-                for(int i = rowStart; i < rowEnd; ++i)
-                {	
-                    for(int j = colStart; j < colEnd; ++j)
-                    {   
-                        unsigned int currentElement = m_baseImage[i][j];
-                        result.addElement(currentElement);
+               return;
+                
+            }
+};
+
+/**
+            
+            Recursive function to split a 2D array into 4 symmetric blocks and queue one task on the pool for each of them. 
+            Recursion bottoms out when there are TILES_PER_THREAD tiles for every worker of the pool or min block size of 2x2 is reached.
+             
+             @param 
+                    tiles - task group that runs the tiles
+                    userImage - a twoDArray object whose downsampled versions we are interested in.
+                    rowStart, rowEnd - row positions of the elements in the baseImage 
+                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
+                    depth - Depth of the cube in the baseImage 
+                    threadNumber - quadrant (1-4) of the last split, recorded in the modeMap of every 2x2 block it reads.  
+                    totalTiles - number of tiles the image has been split into at this depth
+                    
+             @return 
+                    void           
+            */
+            
+template <typename Image>
+void  splitTiles(taskGroup & tiles, Image & userImage, int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber, int totalTiles)
+{
+    int maxTiles = static_cast<int>(tiles.getPool().getThreadCount()) * TILES_PER_THREAD;
+
+    int alignment = userImage.getTileAlignment();
+
+	if(depth > 1 && (rowEnd-rowStart) >= 2*alignment && (colEnd-colStart) >= 2*alignment && totalTiles < maxTiles)
+	{
+        //Splits stay on even rows and cols, or on the alignment of the fused levels, so a lone last row or col is only ever in the last tile
+        int rowMid = alignedMidpoint(rowStart, rowEnd, alignment);
+        int colMid = alignedMidpoint(colStart, colEnd, alignment);
+        taskGroup * group = &tiles;
+        Image * image = &userImage;
+        
+        //In a pinned pool the halves go to the workers whose node first touched their rows
+        int topWorker = tiles.getPool().workerForRow(rowStart, userImage.getRows());
+        int bottomWorker = tiles.getPool().workerForRow(rowMid, userImage.getRows());
+ 
+		tiles.run([=]() { splitTiles(*group, *image, rowStart, rowMid, colStart, colMid, depth-1, 1, totalTiles*4); }, topWorker);
+
+		tiles.run([=]() { splitTiles(*group, *image, rowStart, rowMid, colMid, colEnd, depth-1, 2, totalTiles*4); }, topWorker);
+
+		tiles.run([=]() { splitTiles(*group, *image, rowMid, rowEnd, colStart, colMid, depth-1, 3, totalTiles*4); }, bottomWorker);
+
+		tiles.run([=]() { splitTiles(*group, *image, rowMid, rowEnd, colMid, colEnd, depth-1, 4, totalTiles*4); }, bottomWorker);
+	} 
+	
+	else
+	{
+		traceScope trace("tile", "quadrant", threadNumber, "elements", static_cast<long long>(rowEnd - rowStart) * (colEnd - colStart));
+		if(!userImage.fillUniformTile(rowStart, rowEnd, colStart, colEnd, depth, threadNumber)) userImage.divideCube(rowStart, rowEnd, colStart, colEnd, depth, threadNumber);
+		userImage.fuseTile(rowStart, rowEnd, colStart, colEnd);
+	}
+	return;	
+}
+
+/**
+            
+            Function to read every 2x2 block of a 2D array using the threads of a pool. The array is split into tiles by splitTiles() and 
+            the function returns once all of them have been read.
+             
+             @param 
+                    pool - workers that read the tiles
+                    userImage - a twoDArray object whose downsampled versions we are interested in.
+                    rowStart, rowEnd - row positions of the elements in the baseImage 
+                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
+                    depth - Depth of the cube in the baseImage 
+                    
+             @return 
+                    void           
+            */
+            
+template <typename Image>
+void  startThreading(workStealingPool & pool, Image & userImage, int rowStart, int rowEnd, int colStart, int colEnd, int depth)
+{
+    traceScope trace("startThreading");
+    taskGroup tiles(pool);
+    splitTiles(tiles, userImage, rowStart, rowEnd, colStart, colEnd, depth, 1, 1);
+    tiles.wait();
+    userImage.tilesRead();
+	return;	
+}
+
+
+//Largest number of axes of an ndArray, a cell groups up to 2^ND_MAX_DIMS cells of the level below
+#define ND_MAX_DIMS 8
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* An image with any number of axes and channels, downsampled with the same modeMap cells, accumulators, edge policies and 
+* reduction operators as twoDArray. A volume of slices x rows x cols is downsampled by 2x2x2 blocks, a multi-band raster is 
+* rows x cols with a channel count, and dimensions {rows, cols} with one channel print exactly what twoDArray prints.
+* 
+* Elements are stored with the channels interleaved: channel ch of element (i0, ..., iN-1) is at ((i0*d1 + i1)*d2 + ... )*channels + ch. 
+* Every level is a row-major grid of cells laid out the same way, so one pass over the image or a level builds all channels at once 
+* instead of reading the data again per band or slice.
+*
+* m_dims, m_channels - dimensions of the image, outermost axis first, and number of channels
+* m_levelDims - dimensions of every level, each axis reduced with nextLevelDim() until all of them are at 1
+* m_levels - cells of the levels built so far, m_levelsBuilt of them
+*
+* Along every axis a cell groups indexes 2x and 2x+1 of the level below, and axisPolicy() decides what a lone last index is grouped with. 
+* Level 0 counts the elements directly, the other levels merge histograms with the accumulator histogramStrategy picks, 
+* setting a group of uniform cells of the same value without merging as reduceRowPair() does. 
+* Levels are built in bands of their outermost axis on the pool given to setPool().
+* ---------------------------------------------------------------
+*/
+template <typename Pixel = unsigned int, typename Count = unsigned int>
+class ndArray
+{
+    public:
+        typedef modeMap<Pixel, Count> cellType;
+
+    private:
+        std::vector<int> m_dims;
+        int m_channels;
+        edgePolicy m_policy;
+        size_t m_topK;
+        workStealingPool * m_pool;
+        const Pixel * m_pixels;
+
+        std::vector< std::vector<int> > m_levelDims;
+        std::vector< std::vector<cellType> > m_levels;
+        size_t m_levelsBuilt;
+
+        //Number of cells or elements of a grid
+        static size_t gridSize(const std::vector<int> & dims)
+        {
+            size_t size = 1;
+            for(int dim : dims) size *= static_cast<size_t>(dim);
+            return size;
+        }
+
+        //Throws when reduction reads whole histograms and the levels only keep summaries, see setTopK()
+        template <typename Reduction>
+        void checkReduction(const Reduction &) const
+        {
+            if(Reduction::exactCounts && m_topK > 0) 
+                throw std::runtime_error(std::string("the ") + Reduction::name() + " reduction needs exact levels, it can't be used with a top-k");
+        }
+
+        /**
+        
+        Finds the cells of a grid that a cell of the next level groups. Along every axis it groups 2x and 2x+1, 
+        a lone last index is grouped twice with replicateEdge and once otherwise.
+        
+        @param finer - dimensions of the grid the children are in
+               coordinates - the cell of the next level, one coordinate per axis
+               children - receives the row-major index of every child, a replicated child twice
+        @return number of children, at most 2^N      
+       */
+        int childIndexes(const std::vector<int> & finer, const int * coordinates, size_t * children) const
+        {
+            int count = 1;
+            children[0] = 0;
+
+            for(size_t axis = 0; axis < finer.size(); ++axis)
+            {
+                int size = finer[axis], first = 2 * coordinates[axis];
+                int second = (first + 1 < size) ? first + 1 : first;
+                bool pair = (second != first) || axisPolicy(m_policy, size) == replicateEdge;
+
+                //Walking down lets every index be widened in place
+                for(int i = count - 1; i >= 0; --i)
+                {
+                    size_t base = children[i] * size;
+                    if(pair)
+                    {
+                        children[2 * i] = base + first;
+                        children[2 * i + 1] = base + second;
+                    }
+                    else children[i] = base + first;
+                }
+                if(pair) count *= 2;
+            }
+            return count;
+        }
+
+        /**
+        
+        Builds the cells of a level whose outermost coordinate is in [first, last), for every channel. 
+        Bands that don't overlap only write their own cells, so several threads can build the same level at once.
+        
+        @param level - the level, the one below it has to be built already
+               first, last - range of the outermost axis
+        @return void      
+       */
+        void buildBand(int level, int first, int last)
+        {
+            static thread_local typename histogramStrategy<Pixel, Count>::accumulator merge;
+
+            const std::vector<int> & dims = m_levelDims[level];
+            const std::vector<int> & finer = level ? m_levelDims[level - 1] : m_dims;
+            const cellType * below = level ? m_levels[level - 1].data() : nullptr;
+            cellType * cells = m_levels[level].data();
+
+            size_t children[size_t(1) << ND_MAX_DIMS];
+            int coordinates[ND_MAX_DIMS] = {0};
+            coordinates[0] = first;
+
+            size_t inner = gridSize(dims) / dims[0];
+            uint64_t uniform = 0;
+
+            for(size_t cell = first * inner; cell < last * inner; ++cell)
+            {
+                int count = childIndexes(finer, coordinates, children);
+
+                for(int channel = 0; channel < m_channels; ++channel)
+                {
+                    cellType & out = cells[cell * m_channels + channel];
+
+                    if(!below)
+                    {
+                        for(int i = 0; i < count; ++i) out.addElement(m_pixels[children[i] * m_channels + channel]);
+                        out.calculateMode();
+                        continue;
+                    }
+
+                    const cellType & head = below[children[0] * m_channels + channel];
+                    bool same = (m_topK == 0 && head.isUniform());
+                    Count total = 0;
+                    for(int i = 0; same && i < count; ++i)
+                    {
+                        const cellType & child = below[children[i] * m_channels + channel];
+                        same = child.isUniform() && child.getMode() == head.getMode();
+                        total += child.getCount();
+                    }
+
+                    if(same)
+                    {
+                        out.addElement(head.getMode(), total);
+                        out.setMode(head.getMode(), total);
+                        ++uniform;
+                        continue;
+                    }
+
+                    for(int i = 0; i < count; ++i) merge.add(below[children[i] * m_channels + channel].getCube());
+                    merge.finish(out, m_topK);
+                }
+
+                //Next cell in row-major order
+                for(int axis = static_cast<int>(dims.size()) - 1; axis >= 0 && ++coordinates[axis] == dims[axis]; --axis) coordinates[axis] = 0;
+            }
+
+            if(!below) instrumentation::add(&threadCounters::blocks, (last - first) * inner);
+            instrumentation::add(&threadCounters::uniformCells, uniform);
+        }
+
+        //Builds the levels up to and including level, on the pool in bands when there is one and the level is large enough
+        void buildLevels(int level)
+        {
+            for(; static_cast<int>(m_levelsBuilt) <= level; ++m_levelsBuilt)
+            {
+                int current = static_cast<int>(m_levelsBuilt);
+                const std::vector<int> & dims = m_levelDims[current];
+                traceScope trace("level", "level", current, "cells", static_cast<long long>(gridSize(dims)) * m_channels);
+                m_levels[current].resize(gridSize(dims) * m_channels);
+
+                int bands = 1;
+                if(m_pool && gridSize(dims) * m_channels >= REDUCE_BAND_CELLS) 
+                    bands = static_cast<int>(std::min<size_t>(dims[0], m_pool->getThreadCount() * TILES_PER_THREAD));
+
+                if(bands <= 1)
+                {
+                    buildBand(current, 0, dims[0]);
+                    continue;
+                }
+
+                taskGroup group(*m_pool);
+                for(int band = 0; band < bands; ++band)
+                {
+                    int first = static_cast<int>(static_cast<long long>(dims[0]) * band / bands);
+                    int last = static_cast<int>(static_cast<long long>(dims[0]) * (band + 1) / bands);
+                    group.run([=]() { buildBand(current, first, last); }, m_pool->workerForRow(first, dims[0]));
+                }
+                group.wait();
+            }
+        }
+
+    public:
+        /**
+        
+        Constructor for an image whose elements are already in memory, channels interleaved. The elements are read in place 
+        and must stay valid until every level has been built. Throws std::runtime_error for dimensions or channels below 1, 
+        more than ND_MAX_DIMS axes, or more elements per channel than Count can hold.
+        
+        @param pixels - the elements
+               dims - size of every axis, outermost first
+               channels - number of values per element
+               policy - handling of a lone last index along any axis
+        */
+        ndArray(const Pixel * pixels, const std::vector<int> & dims, int channels = 1, edgePolicy policy = partialBlocks)
+            : m_dims(dims), m_channels(channels), m_policy(policy), m_topK(0), m_pool(nullptr), m_pixels(pixels), m_levelsBuilt(0)
+        {
+            if(dims.empty() || dims.size() > ND_MAX_DIMS) throw std::runtime_error("an image needs between 1 and " + std::to_string(ND_MAX_DIMS) + " axes");
+            if(channels < 1 || *std::min_element(dims.begin(), dims.end()) < 1) throw std::runtime_error("dimensions and channels have to be at least 1");
+            checkCountFits<Count>(dims, policy);
+
+            std::vector<int> level = dims;
+            while(*std::max_element(level.begin(), level.end()) > 1)
+            {
+                for(int & dim : level) dim = nextLevelDim(dim, policy);
+                m_levelDims.push_back(level);
+            }
+            m_levels.resize(m_levelDims.size());
+        }
+
+        //Keep at most topK values per cell above level 0, see twoDArray::setTopK(). Has to be called before any level is built.
+        void setTopK(size_t topK) { m_topK = topK; }
+
+        //Pool the levels are built on in bands, null to build them on the calling thread
+        void setPool(workStealingPool * pool) { m_pool = pool; }
+
+        int getLevelCount() const { return static_cast<int>(m_levelDims.size()); }
+
+        int getChannels() const { return m_channels; }
+
+        const std::vector<int> & getLevelDims(int level) const { return m_levelDims[level]; }
+
+        /**
+        
+        Reads one channel of a level, building it and the levels below it first if need be. 
+        
+        @param level - the level, 0 is the image of 2x..x2 blocks
+               channel - the channel
+               values - receives the reduction of every cell of the level, row-major
+               reduction - reduction operator giving the value of each cell, the mode by default
+        @return void      
+       */
+        template <typename Reduction = modeReduction<Pixel, Count> >
+        void getLevel(int level, int channel, std::vector<Pixel> & values, const Reduction & reduction = Reduction())
+        {
+            checkReduction(reduction);
+            buildLevels(level);
+
+            const std::vector<cellType> & cells = m_levels[level];
+            values.resize(cells.size() / m_channels);
+            for(size_t cell = 0; cell < values.size(); ++cell) values[cell] = reduction(cells[cell * m_channels + channel]);
+        }
+
+        /**
+        
+        Function to print all downsampled versions of the image, channel after channel, in the format of twoDArray::printDownsampled(). 
+        Every line holds the innermost axis, and every 2D slice of a level ends with an empty line. 
+        With more than one channel each pyramid is headed by "Channel : c".
+        
+        @param out - stream the levels are printed to
+               reduction - reduction operator giving the value printed for each cell, the mode by default
+        @return void      
+       */
+        template <typename Reduction = modeReduction<Pixel, Count> >
+        void printDownsampled(std::ostream & out = std::cout, const Reduction & reduction = Reduction())
+        {
+            checkReduction(reduction);
+            buildLevels(getLevelCount() - 1);
+
+            for(int channel = 0; channel < m_channels; ++channel)
+            {
+                if(m_channels > 1) out << "Channel : " << channel << std::endl;
+
+                for(int level = 0; level < getLevelCount(); ++level)
+                {
+                    const std::vector<int> & dims = m_levelDims[level];
+                    size_t line = dims.back(), slice = (dims.size() > 1) ? line * dims[dims.size() - 2] : line;
+                    const std::vector<cellType> & cells = m_levels[level];
+
+                    for(size_t cell = 0; cell < gridSize(dims); ++cell)
+                    {
+                        out << static_cast<unsigned long>(reduction(cells[cell * m_channels + channel])) << " ";
+                        if((cell + 1) % line == 0) out << std::endl;
+                        if((cell + 1) % slice == 0) out << std::endl;
+                    }
+
+                    if(level + 1 < getLevelCount()) out << "The number of cubes is : " << gridSize(m_levelDims[level + 1]) << std::endl;
+                }
+            }
+        }
+};
+
+
+//Images with at least this many elements are split into tiles by startThreading() when they are part of a batch, smaller ones are read by a single worker
+#define BATCH_SPLIT_PIXELS (512 * 512)
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* One image of a batch given to downsampleBatch(), rows x cols row-major elements owned by the caller.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+struct batchImage
+{
+    const Pixel * pixels;
+    int rows, cols;
+};
+
+/**
+            
+            Function to find every level of a small image on the calling thread, in a pyramidArena owned by the thread. 
+            The arena keeps its cells and their histogram storage between calls, so a worker going through many images 
+            of similar size stops allocating after the first few.
+             
+             @param 
+                    image - the image
+                    policy - edge handling for odd rows and cols
+                    topK - 0 for exact modes, otherwise the size of the summaries kept per cell, see twoDArray::setTopK()
+                    result - receives the modes of every level
+             @return 
+                    void           
+            */
+template <typename Pixel, typename Count>
+void downsampleOnThread(const batchImage<Pixel> & image, edgePolicy policy, size_t topK, pyramidModes<Pixel> & result)
+{
+    static thread_local pyramidArena<Pixel, Count> levels;
+
+    int levelCount = pyramidLevelCount(image.rows, image.cols, policy);
+    result.resize(levelCount);
+    if(levelCount == 0) return;
+    levels.prepare(image.rows, image.cols, policy);
+
+    pyramidLevel<Pixel, Count> & first = levels.getLevel(0);
+
+    edgePolicy rowPolicy = axisPolicy(policy, image.rows), colPolicy = axisPolicy(policy, image.cols);
+    for(int row = 0; row < first.getRows(); ++row)
+    {
+        const Pixel * top = image.pixels + static_cast<size_t>(2 * row) * image.cols;
+        const Pixel * bottom = top + image.cols;
+        if(2 * row + 1 == image.rows) bottom = (rowPolicy == replicateEdge) ? top : nullptr;
+
+        buildBlockRow(top, bottom, image.cols, colPolicy, first.row(row));
+    }
+    instrumentation::add(&threadCounters::blocks, first.size());
+
+    for(int level = 0; level < levelCount; ++level)
+    {
+        if(level > 0) levels.getLevel(level - 1).reduceInto(levels.getLevel(level), policy, topK);
+        result.setLevel(level, levels.getLevel(level));
+    }
+}
+
+/**
+            
+            Function to downsample a batch of images on a shared pool. Every image is a task of its own, so small images are spread 
+            over all workers instead of each being split into tiles. Images of BATCH_SPLIT_PIXELS elements or more are still read in 
+            tiles by startThreading(), on the same pool.
+            
+            The function keeps no state of its own, so it can be called from several threads at once with the same pool. 
+            Workers reuse their levels from one small image to the next, see downsampleOnThread().
+             
+             @param 
+                    pool - workers used for downsampling
+                    images - the images, they must stay valid until the function returns
+                    results - resized to one pyramidModes per image. Passing the same vector again reuses its storage.
+                    policy - edge handling for odd rows and cols
+                    topK - 0 for exact modes, otherwise the size of the summaries kept per cell, see twoDArray::setTopK()
+             @return 
+                    void           
+            */
+template <typename Pixel, typename Count = unsigned int>
+void downsampleBatch(workStealingPool & pool, const std::vector< batchImage<Pixel> > & images, std::vector< pyramidModes<Pixel> > & results, 
+                     edgePolicy policy = partialBlocks, size_t topK = 0)
+{
+    traceScope trace("downsampleBatch", "images", static_cast<long long>(images.size()));
+    for(const batchImage<Pixel> & image : images) checkCountFits<Count>({image.rows, image.cols}, policy);
+    results.resize(images.size());
+
+    taskGroup batch(pool);
+    for(size_t i = 0; i < images.size(); ++i)
+    {
+        const batchImage<Pixel> * image = &images[i];
+        pyramidModes<Pixel> * result = &results[i];
+        workStealingPool * workers = &pool;
+
+        batch.run([image, result, workers, policy, topK]()
+        {
+            if(static_cast<long long>(image->rows) * image->cols < BATCH_SPLIT_PIXELS)
+            {
+                downsampleOnThread<Pixel, Count>(*image, policy, topK, *result);
+                return;
+            }
+
+            twoDArray<Pixel, Count> large(image->pixels, image->rows, image->cols, policy);
+            large.setTopK(topK);
+            large.setPool(workers);
+            startThreading(*workers, large, 0, image->rows, 0, image->cols, large.getDepth());
+            large.mergeAllMaps();
+            large.copyModes(*result);
+        });
+    }
+    batch.wait();
+}
+
+
+
+//Number of independently locked parts of a tileCache, so readers of different tiles rarely wait on each other
+#define TILE_CACHE_SHARDS 16
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Address of a tile served by pyramidTileService: the id of an image, a level, and the col (x) and row (y) of the tile 
+* in the grid of tiles the level is cut into.
+* ---------------------------------------------------------------
+*/
+struct tileKey
+{
+    int image, level, x, y;
+
+    bool operator==(const tileKey & other) const
+    {
+        return image == other.image && level == other.level && x == other.x && y == other.y;
+    }
+};
+
+struct tileKeyHash
+{
+    size_t operator()(const tileKey & key) const
+    {
+        size_t hash = static_cast<size_t>(key.image);
+        hash = hash * 1000003u ^ static_cast<size_t>(key.level);
+        hash = hash * 1000003u ^ static_cast<size_t>(key.x);
+        hash = hash * 1000003u ^ static_cast<size_t>(key.y);
+        return hash;
+    }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* The values of one tile of a level, rows x cols in row-major order. Tiles at the right and bottom of a level may be smaller than the others.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+struct pyramidTile
+{
+    int rows, cols;
+    std::vector<Pixel> values;
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Bounded least recently used cache of tiles, shared by any number of threads. 
+* 
+* Keys are spread over TILE_CACHE_SHARDS shards by hash. Every shard has its own lock, its own list of tiles from most to least 
+* recently used and 1/shards of the memory budget, so readers only wait for each other when their tiles land in the same shard. 
+* When a shard goes over its budget the least recently used tiles are dropped. Tiles are handed out as shared pointers, 
+* so a tile dropped while a reader holds it stays valid until the reader lets go of it.
+*
+* m_shards - the shards: lock, recency list, index into the list and bytes held
+* m_shardBudget - bytes a shard may hold
+* m_hits, m_misses - number of find() calls that found their tile and that didn't
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class tileCache
+{
+    public:
+        typedef std::shared_ptr<const pyramidTile<Pixel> > tilePointer;
+
+    private:
+        typedef std::list< std::pair<tileKey, tilePointer> > recencyList;
+
+        struct shard
+        {
+            std::mutex lock;
+            recencyList order;
+            std::unordered_map<tileKey, typename recencyList::iterator, tileKeyHash> entries;
+            size_t bytes;
+
+            shard(): bytes(0)
+            {
+            }
+        };
+
+        std::vector< std::unique_ptr<shard> > m_shards;
+        size_t m_shardBudget;
+        std::atomic<uint64_t> m_hits, m_misses;
+
+        shard & shardOf(const tileKey & key)
+        {
+            return *m_shards[tileKeyHash()(key) % m_shards.size()];
+        }
+
+        //Memory a cached tile accounts for, its values and the bookkeeping around them
+        static size_t tileBytes(const pyramidTile<Pixel> & tile)
+        {
+            return sizeof(pyramidTile<Pixel>) + tile.values.capacity() * sizeof(Pixel) + 4 * sizeof(void *) + sizeof(tileKey);
+        }
+
+        //Drops the least recently used tiles of a shard until it fits its budget. The shard must be locked.
+        void evict(shard & part)
+        {
+            while(part.bytes > m_shardBudget && !part.order.empty())
+            {
+                part.bytes -= tileBytes(*part.order.back().second);
+                part.entries.erase(part.order.back().first);
+                part.order.pop_back();
+            }
+        }
+
+    public:
+    /**
+        Constructor
+        
+        @param budget - bytes the cache may hold in all
+               shards - number of independently locked shards
+        */
+        explicit tileCache(size_t budget, int shards = TILE_CACHE_SHARDS): m_shardBudget(budget / std::max(1, shards)), m_hits(0), m_misses(0)
+        {
+            for(int i = 0; i < std::max(1, shards); ++i) m_shards.push_back(std::unique_ptr<shard>(new shard()));
+        }
+
+        /**
+        
+        Looks a tile up and marks it as the most recently used one of its shard. 
+        
+        @param key - the tile
+        @return the tile, or null when it isn't cached
+       */
+        tilePointer find(const tileKey & key)
+        {
+            shard & part = shardOf(key);
+            std::unique_lock<std::mutex> guard = instrumentation::lock(part.lock);
+
+            auto entry = part.entries.find(key);
+            if(entry == part.entries.end())
+            {
+                ++m_misses;
+                return tilePointer();
+            }
+
+            ++m_hits;
+            part.order.splice(part.order.begin(), part.order, entry->second);
+            return entry->second->second;
+        }
+
+        /**
+        
+        Adds a tile as the most recently used one of its shard, replacing any tile cached under the same key, 
+        and drops older tiles to stay within the budget. A tile larger than the budget of a shard is not kept.
+        
+        @param key - the tile
+               tile - its values
+        @return void
+       */
+        void insert(const tileKey & key, const tilePointer & tile)
+        {
+            shard & part = shardOf(key);
+            std::unique_lock<std::mutex> guard = instrumentation::lock(part.lock);
+
+            auto entry = part.entries.find(key);
+            if(entry != part.entries.end())
+            {
+                part.bytes -= tileBytes(*entry->second->second);
+                part.order.erase(entry->second);
+                part.entries.erase(entry);
+            }
+
+            if(tileBytes(*tile) > m_shardBudget) return;
+
+            part.order.push_front(std::make_pair(key, tile));
+            part.entries[key] = part.order.begin();
+            part.bytes += tileBytes(*tile);
+            evict(part);
+        }
+
+        //Drops every tile of an image, for example once its pixels have changed
+        void eraseImage(int image)
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i)
+            {
+                shard & part = *m_shards[i];
+                std::unique_lock<std::mutex> guard = instrumentation::lock(part.lock);
+
+                for(auto entry = part.order.begin(); entry != part.order.end();)
+                {
+                    if(entry->first.image != image) { ++entry; continue; }
+
+                    part.bytes -= tileBytes(*entry->second);
+                    part.entries.erase(entry->first);
+                    entry = part.order.erase(entry);
+                }
+            }
+        }
+
+        //Bytes held by all shards together
+        size_t getBytes()
+        {
+            size_t bytes = 0;
+            for(size_t i = 0; i < m_shards.size(); ++i)
+            {
+                std::unique_lock<std::mutex> guard = instrumentation::lock(m_shards[i]->lock);
+                bytes += m_shards[i]->bytes;
+            }
+            return bytes;
+        }
+
+        uint64_t getHits() const { return m_hits.load(); }
+        uint64_t getMisses() const { return m_misses.load(); }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Serves the levels of any number of images as square tiles of m_tileSize x m_tileSize values, addressed by tileKey. 
+* 
+* Tiles are computed on demand with twoDArray::getRegion(), which only builds the cells the tile needs and keeps them, 
+* and the values are kept in a tileCache with a fixed memory budget. A viewport that is read again is then served from 
+* the cache without merging any histogram. readTile() can be called from several threads at once.
+* The images are not owned, they must outlive the service or be removed first. After changing the pixels of an image, 
+* call invalidate() so its cached tiles are recomputed.
+*
+* m_tileSize - rows and cols of a tile
+* m_cache - the computed tiles
+* m_images - the images by id, guarded by m_imagesLock
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class pyramidTileService
+{
+    public:
+        typedef twoDArray<Pixel, Count> imageType;
+        typedef typename tileCache<Pixel>::tilePointer tilePointer;
+
+    private:
+        int m_tileSize;
+        tileCache<Pixel> m_cache;
+        std::mutex m_imagesLock;
+        std::unordered_map<int, imageType *> m_images;
+
+        imageType & findImage(int id)
+        {
+            std::lock_guard<std::mutex> guard(m_imagesLock);
+            auto image = m_images.find(id);
+            if(image == m_images.end()) throw std::runtime_error("no image with id " + std::to_string(id));
+            return *image->second;
+        }
+
+    public:
+    /**
+        Constructor
+        
+        @param budget - bytes the tile cache may hold
+               tileSize - rows and cols of a tile
+        */
+        explicit pyramidTileService(size_t budget, int tileSize = 256): m_tileSize(std::max(1, tileSize)), m_cache(budget)
+        {
+        }
+
+        //Serves the levels of image under id, replacing any image served under it before
+        void addImage(int id, imageType & image)
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_imagesLock);
+                m_images[id] = &image;
+            }
+            m_cache.eraseImage(id);
+        }
+
+        //Stops serving an image and drops its tiles
+        void removeImage(int id)
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_imagesLock);
+                m_images.erase(id);
+            }
+            m_cache.eraseImage(id);
+        }
+
+        //Drops the cached tiles of an image whose pixels have changed
+        void invalidate(int id)
+        {
+            m_cache.eraseImage(id);
+        }
+
+        /**
+        
+        Function to read one tile of a level, from the cache when it has been read before. 
+        
+        @param id - the image
+               level - the level, 0 being the 2x2 blocks of the base image
+               x, y - col and row of the tile in the grid of tiles of the level
+        @return the tile, which stays valid as long as it is held
+       */
+        tilePointer readTile(int id, int level, int x, int y)
+        {
+            tileKey key = { id, level, x, y };
+            tilePointer cached = m_cache.find(key);
+            if(cached) return cached;
+
+            imageType & image = findImage(id);
+            if(level < 0 || level >= image.getLevelCount()) throw std::runtime_error("no such level");
+
+            int rows = image.getLevelRows(level), cols = image.getLevelCols(level);
+            if(x < 0 || y < 0 || static_cast<long long>(x) * m_tileSize >= cols || static_cast<long long>(y) * m_tileSize >= rows) 
+                throw std::runtime_error("tile outside the level");
+
+            std::shared_ptr< pyramidTile<Pixel> > tile(new pyramidTile<Pixel>());
+            int rowStart = y * m_tileSize, colStart = x * m_tileSize;
+            tile->rows = std::min(m_tileSize, rows - rowStart);
+            tile->cols = std::min(m_tileSize, cols - colStart);
+            image.getRegion(level, rowStart, rowStart + tile->rows, colStart, colStart + tile->cols, tile->values);
+
+            m_cache.insert(key, tile);
+            return tile;
+        }
+
+        int getTileSize() const { return m_tileSize; }
+        tileCache<Pixel> & getCache() { return m_cache; }
+};
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Interface for anything that can hand out the rows of a baseImage, a few rows at a time. 
+* 
+* getRows(), getCols() - dimensions of the whole image
+* readRows() - copies numRows rows starting at firstRow into destination, row-major with getCols() elements per row
+* concurrentReads() - true when readRows() can be called from several threads at once for different rows, see readImageRows()
+* data() - the whole image, row-major, when the source already holds it in memory and it can be read in place. Null otherwise.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class imageSource
+{
+    public:
+        virtual int getRows() const = 0;
+        virtual int getCols() const = 0;
+        virtual void readRows(int firstRow, int numRows, Pixel * destination) = 0;
+        virtual bool concurrentReads() const { return false; }
+        virtual const Pixel * data() const { return nullptr; }
+        virtual ~imageSource() {}
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* imageSource producing the same values as the twoDArray constructor, rand()%9 in row-major order. 
+* Rows have to be read in order from the top since every value comes from the next call to rand().
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class randomImageSource : public imageSource<Pixel>
+{
+    private:
+        int m_rows, m_cols;
+
+    public:
+    /**
+        Constructor
+        */
+        randomImageSource(int rows, int cols): m_rows(rows), m_cols(cols)
+        {
+        }
+
+        int getRows() const { return m_rows; }
+
+        int getCols() const { return m_cols; }
+
+        //rand() has a single sequence, so the rows have to be read once each, in order and from one thread, which is why concurrentReads() is false
+        void readRows(int /*firstRow*/, int numRows, Pixel * destination)
+        {
+            size_t elements = static_cast<size_t>(numRows) * m_cols;
+            for(size_t i = 0; i < elements; ++i) destination[i] = static_cast<Pixel>(rand()%9);
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* imageSource generating values below domain from a counter based generator: every element is a hash of the seed and its row-major position, 
+* so rows can be read in any order and from any number of threads and the image is the same for a given seed.
+* The values differ from the ones of randomImageSource.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class counterImageSource : public imageSource<Pixel>
+{
+    private:
+        int m_rows, m_cols;
+        uint64_t m_seed;
+        unsigned int m_domain;
+
+    public:
+    /**
+        Constructor
+        */
+        counterImageSource(int rows, int cols, uint64_t seed, unsigned int domain = 9): m_rows(rows), m_cols(cols), m_seed(seed), m_domain(std::max(1u, domain))
+        {
+        }
+
+        //splitmix64 finalizer of the position offset by the seed
+        static uint64_t hash(uint64_t seed, uint64_t position)
+        {
+            uint64_t z = seed + (position + 1) * 0x9E3779B97F4A7C15ULL;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        }
+
+        int getRows() const { return m_rows; }
+
+        int getCols() const { return m_cols; }
+
+        bool concurrentReads() const { return true; }
+
+        void readRows(int firstRow, int numRows, Pixel * destination)
+        {
+            uint64_t first = static_cast<uint64_t>(firstRow) * m_cols;
+            size_t elements = static_cast<size_t>(numRows) * m_cols;
+            for(size_t i = 0; i < elements; ++i) destination[i] = static_cast<Pixel>(hash(m_seed, first + i) % m_domain);
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* imageSource over row-major elements owned by the caller. data() hands them out, so the image is adopted without being copied, 
+* and they must stay valid for as long as they are read.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class bufferImageSource : public imageSource<Pixel>
+{
+    private:
+        const Pixel * m_pixels;
+        int m_rows, m_cols;
+
+    public:
+    /**
+        Constructor
+        */
+        bufferImageSource(const Pixel * pixels, int rows, int cols): m_pixels(pixels), m_rows(rows), m_cols(cols)
+        {
+        }
+
+        int getRows() const { return m_rows; }
+
+        int getCols() const { return m_cols; }
+
+        bool concurrentReads() const { return true; }
+
+        const Pixel * data() const { return m_pixels; }
+
+        void readRows(int firstRow, int numRows, Pixel * destination)
+        {
+            const Pixel * first = m_pixels + static_cast<size_t>(firstRow) * m_cols;
+            std::copy(first, first + static_cast<size_t>(numRows) * m_cols, destination);
+            instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(numRows) * m_cols * sizeof(Pixel));
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* imageSource reading a raw file of row-major Pixel values in the native byte order, with no header. 
+* Rows can be read in any order. Reads go through pread() at their own offset, so several threads can read at once.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class rawFileSource : public imageSource<Pixel>
+{
+    private:
+        int m_rows, m_cols;
+        int m_descriptor;
+
+        rawFileSource(const rawFileSource &);
+        rawFileSource & operator=(const rawFileSource &);
+
+    public:
+    /**
+        Constructor. Throws std::runtime_error if the file can't be opened.
+        */
+        rawFileSource(const std::string & path, int rows, int cols): m_rows(rows), m_cols(cols), m_descriptor(open(path.c_str(), O_RDONLY))
+        {
+            if(m_descriptor < 0) throw std::runtime_error("cannot open " + path);
+        }
+
+        ~rawFileSource()
+        {
+            close(m_descriptor);
+        }
+
+        int getRows() const { return m_rows; }
+
+        int getCols() const { return m_cols; }
+
+        bool concurrentReads() const { return true; }
+
+        void readRows(int firstRow, int numRows, Pixel * destination)
+        {
+            size_t rowBytes = static_cast<size_t>(m_cols) * sizeof(Pixel);
+            char * bytes = reinterpret_cast<char *>(destination);
+            size_t length = numRows * rowBytes, done = 0;
+            off_t offset = static_cast<off_t>(firstRow) * rowBytes;
+
+            //pread() may return fewer bytes than asked for, it returns 0 at the end of the file
+            while(done < length)
+            {
+                ssize_t got = pread(m_descriptor, bytes + done, length - done, offset + done);
+                if(got <= 0) throw std::runtime_error("raw image file is shorter than the given dimensions");
+                done += static_cast<size_t>(got);
+            }
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Interface that receives the downsampled levels one row at a time. 
+* 
+* Level 0 is the image of 2x2 block modes, level l is downsampled by 2^(l+1). 
+* Rows of one level arrive in order, but rows of different levels are interleaved.
+* writeBaseRows() receives every strip of the base image as it is read, sinks that don't store the base image ignore it.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class levelSink
+{
+    public:
+        virtual void writeRow(int level, int row, const Pixel * modes, int count) = 0;
+        virtual void writeBaseRows(int /*firstRow*/, int /*numRows*/, const Pixel * /*elements*/) {}
+        virtual ~levelSink() {}
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* levelSink writing every level to its own text file, <prefix>.level<l>.txt with l = level + 1, 
+* in the same format printDownsampled() uses for one level.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class textLevelSink : public levelSink<Pixel>
+{
+    private:
+        std::vector< std::unique_ptr<std::ofstream> > m_files;
+
+    public:
+    /**
+        Constructor. Throws std::runtime_error if a file can't be created.
+        */
+        textLevelSink(const std::string & prefix, int levels)
+        {
+            for(int level = 0; level < levels; ++level)
+            {
+                std::string path = prefix + ".level" + std::to_string(level + 1) + ".txt";
+                m_files.push_back(std::unique_ptr<std::ofstream>(new std::ofstream(path.c_str())));
+                if(!*m_files.back()) throw std::runtime_error("cannot create " + path);
+            }
+        }
+
+        void writeRow(int level, int /*row*/, const Pixel * modes, int count)
+        {
+            std::ofstream & file = *m_files[level];
+            for(int c = 0; c < count; ++c) file << static_cast<unsigned long>(modes[c]) << " ";
+            file << "\n";
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* imageSource reading the base image of a mapped pyramidFile. Rows can be read in any order.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class containerImageSource : public imageSource<Pixel>
+{
+    private:
+        pyramidFile & m_file;
+
+    public:
+    /**
+        Constructor
+        */
+        explicit containerImageSource(pyramidFile & file): m_file(file)
+        {
+        }
+
+        int getRows() const { return m_file.getRows(); }
+
+        int getCols() const { return m_file.getCols(); }
+
+        bool concurrentReads() const { return true; }
+
+        const Pixel * data() const { return m_file.template getBaseImage<Pixel>(); }
+
+        void readRows(int firstRow, int numRows, Pixel * destination)
+        {
+            const Pixel * first = m_file.template getBaseImage<Pixel>() + static_cast<size_t>(firstRow) * getCols();
+            std::copy(first, first + static_cast<size_t>(numRows) * getCols(), destination);
+            instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(numRows) * getCols() * sizeof(Pixel));
+        }
+};
+
+/**
+            
+            Function to read rows of an image source into destination. Sources that allow concurrentReads() are read in bands of rows, 
+            TILES_PER_THREAD bands for every worker of the pool, so a generated or raw image is populated at full core count. 
+            In a pinned pool every band is read by the worker workerForRow() gives it, which first touches the rows on its node when 
+            destination hasn't been written yet. Other sources, like randomImageSource, are read in one call from the calling thread.
+             
+             @param 
+                    source - the image source
+                    pool - pool running the bands, or null to read serially
+                    firstRow, numRows - the rows to read
+                    destination - receives the rows, row-major with source.getCols() elements per row
+             @return 
+                    void           
+            */
+template <typename Pixel>
+void readImageRows(imageSource<Pixel> & source, workStealingPool * pool, int firstRow, int numRows, Pixel * destination)
+{
+    int bands = (pool && source.concurrentReads()) ? static_cast<int>(std::min<size_t>(numRows, pool->getThreadCount() * TILES_PER_THREAD)) : 1;
+    if(bands <= 1)
+    {
+        source.readRows(firstRow, numRows, destination);
+        return;
+    }
+
+    size_t cols = source.getCols();
+    imageSource<Pixel> * from = &source;
+    taskGroup group(*pool);
+    for(int band = 0; band < bands; ++band)
+    {
+        int bandStart = numRows * band / bands, bandEnd = numRows * (band + 1) / bands;
+        group.run([=]()
+        {
+            traceScope trace("read", "rows", bandEnd - bandStart);
+            from->readRows(firstRow + bandStart, bandEnd - bandStart, destination + bandStart * cols);
+        }, pool->workerForRow(bandStart, numRows));
+    }
+    group.wait();
+}
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* levelSink writing the base image and every level into a pyramidFile created for the same dimensions.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel>
+class containerLevelSink : public levelSink<Pixel>
+{
+    private:
+        pyramidFile & m_file;
+
+    public:
+    /**
+        Constructor
+        */
+        explicit containerLevelSink(pyramidFile & file): m_file(file)
+        {
+        }
+
+        void writeRow(int level, int row, const Pixel * modes, int count)
+        {
+            std::copy(modes, modes + count, m_file.template getLevel<Pixel>(level) + static_cast<size_t>(row) * m_file.getLevelCols(level));
+        }
+
+        void writeBaseRows(int firstRow, int numRows, const Pixel * elements)
+        {
+            std::copy(elements, elements + static_cast<size_t>(numRows) * m_file.getCols(), m_file.template getBaseImage<Pixel>() + static_cast<size_t>(firstRow) * m_file.getCols());
+            instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(numRows) * m_file.getCols() * sizeof(Pixel));
+        }
+};
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* This class downsamples an image that does not have to fit in memory. 
+* 
+* The image is read from an imageSource in horizontal strips of m_stripRows rows. The 2x2 blocks of a strip are read on the pool, 
+* one task per pair of rows, a few pairs at a time into a ring of one row of blocks per worker. Every row of blocks is then pushed up the pyramid: each level keeps at most one row in m_pending, 
+* waiting for the row below it. When the second row arrives the pair is grouped into a row of the next level and the pending row is released. 
+* A level of a single row is grouped on its own right away, and a row still pending once the image has been read is the lone last row 
+* of its level, which is grouped according to m_policy.
+*
+* A row is handed to the levelSink as soon as it has been made, so every level is written out while the image is still being read. 
+* Apart from the strip, the memory held is one row of modeMap objects per worker for the ring and two rows per level, 
+* whatever m_stripRows is. The row buffers are swapped and cleared rather than reallocated, so after the first few rows the downsampler stops allocating.
+* ---------------------------------------------------------------
+*/
+template <typename Pixel, typename Count = unsigned int>
+class stripDownsampler
+{
+    public:
+        typedef modeMap<Pixel, Count> cellType;
+
+    private:
+        imageSource<Pixel> & m_source;
+        levelSink<Pixel> & m_sink;
+        workStealingPool & m_pool;
+        int m_stripRows, m_levelCount;
+        edgePolicy m_policy;
+        size_t m_topK;
+        std::vector<int> m_levelRows, m_levelCols;
+
+        std::vector<Pixel> m_strip;
+        std::vector< std::vector<cellType> > m_stripBlocks;
+        std::vector< std::vector<cellType> > m_pending;
+        std::vector< std::vector<cellType> > m_reduced;
+        std::vector<bool> m_hasPending;
+        std::vector<int> m_rowsWritten;
+        std::vector<Pixel> m_modes;
+
+        /**
+        
+        Writes a finished row of a level to the sink and pairs it with the pending row of that level, if there is one.
+        
+        @param level - level of the row
+               cells - the row, it may be swapped into m_pending
+        @return void      
+       */
+        void pushRow(int level, std::vector<cellType> & cells)
+        {
+            m_modes.resize(cells.size());
+            for(size_t c = 0; c < cells.size(); ++c) m_modes[c] = cells[c].getMode();
+            m_sink.writeRow(level, m_rowsWritten[level]++, m_modes.data(), static_cast<int>(cells.size()));
+
+            if(level + 1 >= m_levelCount) return;
+
+            if(m_levelRows[level] == 1)
+            {
+                reduceRows(level, cells.data(), nullptr);
+                return;
+            }
+
+            if(!m_hasPending[level])
+            {
+                m_pending[level].swap(cells);
+                m_hasPending[level] = true;
+                return;
+            }
+
+            m_hasPending[level] = false;
+            reduceRows(level, m_pending[level].data(), cells.data());
+        }
+
+        //Makes row cols empty cells. The cells are cleared rather than rebuilt, so row buffers and their histograms are reused from row to row.
+        static void emptyRow(std::vector<cellType> & row, int cols)
+        {
+            row.resize(cols);
+            for(int c = 0; c < cols; ++c) row[c].clear();
+        }
+
+        /**
+        
+        Groups one or two rows of a level into a row of the next level and pushes it.
+        
+        @param level - level of the rows
+               top, bottom - the rows, bottom is null when top is grouped on its own
+        @return void      
+       */
+        void reduceRows(int level, cellType * top, cellType * bottom)
+        {
+            std::vector<cellType> & coarser = m_reduced[level + 1];
+            emptyRow(coarser, m_levelCols[level + 1]);
+            pyramidLevel<Pixel, Count>::reduceRowPair(top, bottom, m_levelCols[level], m_levelCols[level + 1], axisPolicy(m_policy, m_levelCols[level]), coarser.data(), m_topK);
+
+            pushRow(level + 1, coarser);
+        }
+
+        /**
+        
+        Groups the rows still pending once the whole image has been read, from the lowest level up.
+        
+        @param void
+        @return void      
+       */
+        void flushPending()
+        {
+            for(int level = 0; level + 1 < m_levelCount; ++level)
+            {
+                if(!m_hasPending[level]) continue;
+                m_hasPending[level] = false;
+
+                edgePolicy rowPolicy = axisPolicy(m_policy, m_levelRows[level]);
+                if(rowPolicy == ignoreEdge) continue;
+
+                cellType * top = m_pending[level].data();
+                reduceRows(level, top, (rowPolicy == replicateEdge) ? top : nullptr);
+            }
+        }
+
+    public:
+    /**
+        Constructor
+        
+        @param source - image to downsample
+               sink - receives the levels
+               pool - workers that read the 2x2 blocks of a strip
+               stripRows - rows read from the source at a time, rounded up to an even number
+               policy - handling of the last row and col of the image and the levels when there is an odd number of them
+               topK - 0 for exact modes, otherwise the size of the summaries kept per cell above level 0, see twoDArray::setTopK()
+        */
+        stripDownsampler(imageSource<Pixel> & source, levelSink<Pixel> & sink, workStealingPool & pool, int stripRows = 256, edgePolicy policy = partialBlocks, size_t topK = 0)
+            : m_source(source), m_sink(sink), m_pool(pool), m_stripRows(std::max(2, stripRows + stripRows % 2)), m_levelCount(0), m_policy(policy), m_topK(topK)
+        {
+            m_levelCount = pyramidLevelCount(checkedDim(source.getRows()), checkedDim(source.getCols()), policy);
+            checkCountFits<Count>({source.getRows(), source.getCols()}, policy);
+
+            for(int level = 0, rows = source.getRows(), cols = source.getCols(); level < m_levelCount; ++level)
+            {
+                rows = nextLevelDim(rows, policy);
+                cols = nextLevelDim(cols, policy);
+                m_levelRows.push_back(rows);
+                m_levelCols.push_back(cols);
+            }
+
+            m_pending.resize(m_levelCount);
+            m_reduced.resize(m_levelCount);
+            m_hasPending.assign(m_levelCount, false);
+            m_rowsWritten.assign(m_levelCount, 0);
+        }
+
+        //Number of levels written to the sink
+        int getLevelCount() const { return m_levelCount; }
+
+        /**
+        
+        Reads the whole image strip by strip and writes every level to the sink.
+        
+        @param void
+        @return void      
+       */
+        void run()
+        {
+            int rows = m_source.getRows(), cols = m_source.getCols();
+            edgePolicy rowPolicy = axisPolicy(m_policy, rows), colPolicy = axisPolicy(m_policy, cols);
+            m_strip.resize(static_cast<size_t>(m_stripRows) * cols);
+            m_stripBlocks.resize(std::min<size_t>(m_stripRows / 2, std::max(1u, m_pool.getThreadCount())));
+            int ring = static_cast<int>(m_stripBlocks.size());
+
+            for(int firstRow = 0; firstRow < rows; firstRow += m_stripRows)
+            {
+                int stripRows = std::min(m_stripRows, rows - firstRow);
+                traceScope trace("strip", "firstRow", firstRow, "rows", stripRows);
+                readImageRows(m_source, &m_pool, firstRow, stripRows, m_strip.data());
+                m_sink.writeBaseRows(firstRow, stripRows, m_strip.data());
+
+                //Only the last strip can end with a lone row, it is dropped when it is ignored
+                int pairs = (rowPolicy == ignoreEdge) ? stripRows / 2 : (stripRows + 1) / 2;
+                if(m_levelCount == 0) pairs = 0;
+
+                //The pairs are read ring rows at a time, so the rows of blocks held don't grow with the strip
+                for(int firstPair = 0; firstPair < pairs; firstPair += ring)
+                {
+                    int batch = std::min(ring, pairs - firstPair);
+                    {
+                        taskGroup blocks(m_pool);
+                        for(int slot = 0; slot < batch; ++slot)
+                        {
+                            int pair = firstPair + slot;
+                            blocks.run([this, pair, slot, cols, stripRows, rowPolicy, colPolicy]()
+                            {
+                                const Pixel * top = m_strip.data() + static_cast<size_t>(2*pair) * cols;
+                                const Pixel * bottom = top + cols;
+                                if(2*pair + 1 == stripRows) bottom = (rowPolicy == replicateEdge) ? top : nullptr;
+
+                                emptyRow(m_stripBlocks[slot], m_levelCols[0]);
+                                buildBlockRow(top, bottom, cols, colPolicy, m_stripBlocks[slot].data());
+                                instrumentation::add(&threadCounters::blocks, m_levelCols[0]);
+                            });
+                        }
+                        blocks.wait();
                     }
+
+                    for(int slot = 0; slot < batch; ++slot) pushRow(0, m_stripBlocks[slot]);
                 }
-                
-                result.setDepth(depth);
-                result.setthreadNumber(threadNumber);	
-                result.calculateMode();
-                return result;
+            }
+
+            flushPending();
+        }
+};
+
+
+
+/*----------------------------------------------------------
+* DESCRIPTION
+* 
+* Settings read from the command line by main().
+*
+* threads - "--threads N", number of worker threads. 0 means one per core.
+* bits - "--bits 8|16|32", element width of generated and raw images. Containers record their own width.
+* stream - "--stream", downsample strip by strip. "--strip-rows N" sets the strip height, streamed levels go to <prefix>.level<l>.txt, "--prefix PREFIX".
+* inputPath - "--input FILE", a pyramid container, or a raw file of elements with the dimensions entered at the prompt.
+* generator - "--generator rand|counter", how the image is generated without an input. rand, the default, fills it serially with rand()%9, 
+*             counter fills it on every worker with counterImageSource, the same image for any number of threads. "--seed N" seeds both (3).
+* outputPath - "--output FILE", write the base image and every level into a pyramid container instead of printing them.
+* edge - "--edge partial|replicate|ignore", edgePolicy for images and levels with an odd number of rows or cols.
+* reductions - "--reduce mode,mean,min,max,median,weighted", reduction operators the levels are output with, in one pass. "--weights W0,W1,..." 
+*              weighs the values for the weighted mode. Extra operators print after the first, or are written to <output>.<name> containers.
+* level - "--level K", print only level K, computing just the cells it needs with twoDArray::getRegion(). -1, the default, prints every level.
+*         "--region ROW,COL,ROWS,COLS" narrows it to a rectangle of the level.
+* tiles - "--tiles L:X:Y,...", print those tiles through a pyramidTileService instead of the levels, "--tile-size N" values a side (256), 
+*         "--cache-mb N" megabytes of tile cache (64).
+* numa - "--numa", pin the workers to the NUMA nodes and first touch every band of the image and of the levels on the node that reads it, 
+*        see workStealingPool and pyramidArena.
+* slices, channels - "--slices N", downsample a volume of N slices of the entered dimensions by 2x2x2 blocks, "--channels N" with N values 
+*                    per element, interleaved. Either one switches to an ndArray, whose levels are only printed. 0 slices and 1 channel by default.
+* morton - "--morton", copy the base image into a Z-order layout before reading it, see twoDArray::useMortonLayout().
+* fuseLevels - "--fuse-levels K", build levels 1 to K inside every tile while it is read, see twoDArray::setFusedLevels(). 0 by default.
+* topK - "--top-k K", keep at most K values per cell of the downsampled levels, trading exact modes for bounded memory. 0, the default, is exact.
+* benchmark - "--benchmark", time generated images instead of downsampling one, and print the results as JSON. 
+*             Comma separated lists pick the runs: "--dims RxC,...", "--threads-list N,...", "--domains N,...", 
+*             "--distributions uniform,clustered,constant". Every combination is run "--repeat N" times. 
+*             "--batch N" times downsampleBatch() on N copies of every image instead of the phases of a single one.
+* tracePath - "--trace FILE", switch instrumentation on and write the counters and trace events to FILE as Chrome trace event JSON.
+* ---------------------------------------------------------------
+*/
+struct commandLineOptions
+{
+    unsigned int threads;
+    int bits;
+    bool stream, benchmark, morton, numa;
+    std::string prefix, inputPath, outputPath, generator, edge, tracePath, reductions, weights, region, tiles;
+    std::string dims, threadCounts, domains, distributions;
+    int stripRows, repeat, batch, fuseLevels, level, tileSize, cacheMegabytes, slices, channels;
+    size_t topK;
+    unsigned int seed;
+
+    commandLineOptions(): threads(0), bits(32), stream(false), benchmark(false), morton(false), numa(false), prefix("downsampled"), generator("rand"), edge("partial"), reductions("mode"), 
+                          dims("1024x1024,4096x4096"), domains("9,256"), distributions("uniform,clustered,constant"), stripRows(256), repeat(3), batch(0), fuseLevels(0), level(-1), tileSize(256), cacheMegabytes(64), slices(0), channels(1), topK(0), seed(3)
+    {
+    }
+};
+
+//Splits a comma separated list
+std::vector<std::string> splitList(const std::string & list)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    for(std::string item; std::getline(stream, item, ',');) if(!item.empty()) items.push_back(item);
+    return items;
+}
+
+//Reduction operators named by "--reduce". Throws std::runtime_error for an unknown name.
+std::vector<std::string> parseReductions(const std::string & list)
+{
+    std::vector<std::string> names = splitList(list);
+    if(names.empty()) throw std::runtime_error("--reduce needs at least one reduction");
+
+    for(const std::string & name : names)
+    {
+        if(name != "mode" && name != "mean" && name != "min" && name != "max" && name != "median" && name != "weighted")
+            throw std::runtime_error("--reduce has to be a list of mode, mean, min, max, median and weighted");
+    }
+    return names;
+}
+
+//Prints the levels of image reduced by reduction, or writes them into output when there is one
+template <typename Pixel, typename Count, typename Reduction>
+void outputLevels(twoDArray<Pixel, Count> & image, const Reduction & reduction, pyramidFile * output)
+{
+    if(output) image.writeDownsampled(*output, reduction);
+    else image.printDownsampled(std::cout, reduction);
+}
+
+//Prints the levels of an ndArray reduced by reduction. Containers only hold 2D images, so there can't be an output.
+template <typename Pixel, typename Count, typename Reduction>
+void outputLevels(ndArray<Pixel, Count> & image, const Reduction & reduction, pyramidFile * output)
+{
+    if(output) throw std::runtime_error("--slices and --channels only print the levels");
+    image.printDownsampled(std::cout, reduction);
+}
+
+/**
+            
+            Function to output the levels of an image reduced by one of the operators named by "--reduce". 
+            Every operator reads the same levels, so the image is only downsampled once however many of them are asked for.
+             
+             @param 
+                    image - the downsampled image, a twoDArray or an ndArray
+                    name - name of the reduction operator
+                    weights - "--weights", the weight of every value for the weighted mode
+                    output - container receiving the levels, or null to print them
+             @return 
+                    void           
+            */
+template <typename Pixel, typename Count, template <typename, typename> class Image>
+void outputReduction(Image<Pixel, Count> & image, const std::string & name, const std::vector<double> & weights, pyramidFile * output)
+{
+    if(name == "mode") outputLevels(image, modeReduction<Pixel, Count>(), output);
+    else if(name == "mean") outputLevels(image, meanReduction<Pixel, Count>(), output);
+    else if(name == "min") outputLevels(image, minReduction<Pixel, Count>(), output);
+    else if(name == "max") outputLevels(image, maxReduction<Pixel, Count>(), output);
+    else if(name == "median") outputLevels(image, medianReduction<Pixel, Count>(), output);
+    else if(name == "weighted") outputLevels(image, weightedModeReduction<Pixel, Count>(weights), output);
+    else throw std::runtime_error("unknown reduction " + name);
+}
+
+//edgePolicy named by "--edge". Throws std::runtime_error for an unknown name.
+edgePolicy parseEdgePolicy(const std::string & name)
+{
+    if(name == "partial") return partialBlocks;
+    if(name == "replicate") return replicateEdge;
+    if(name == "ignore") return ignoreEdge;
+    throw std::runtime_error("--edge has to be partial, replicate or ignore");
+}
+
+//Number of workers named by "--threads" or an entry of "--threads-list", 0 for one per core. 
+//Throws std::runtime_error with message for anything but a whole number of 0 or more.
+unsigned int parseThreadCount(const std::string & text, const char * message = "--threads has to be a number of threads, 0 for one per core")
+{
+    char * end = nullptr;
+    long threads = std::strtol(text.c_str(), &end, 10);
+    if(text.empty() || *end != '\0' || threads < 0 || threads > std::numeric_limits<int>::max()) 
+        throw std::runtime_error(message);
+    return static_cast<unsigned int>(threads);
+}
+
+//Image source for the input named by the options: the input container, a raw file or a generator. Throws std::runtime_error for an unknown generator.
+template <typename Pixel>
+imageSource<Pixel> * makeImageSource(const commandLineOptions & options, pyramidFile * input, int rows, int cols)
+{
+    if(input) return new containerImageSource<Pixel>(*input);
+    if(!options.inputPath.empty()) return new rawFileSource<Pixel>(options.inputPath, rows, cols);
+    if(options.generator == "counter") return new counterImageSource<Pixel>(rows, cols, options.seed);
+    if(options.generator == "rand") return new randomImageSource<Pixel>(rows, cols);
+    throw std::runtime_error("--generator has to be rand or counter");
+}
 
-            }            
-            
-             /**
-            
-            Function to add a mapMode object to one of the m_mapCollectThread1(2,3,4) objects.            
-            Mutexes are added to prevent race aroud conditions
+/**
             
+            Function to downsample a volume or a multi-band image with an ndArray, for "--slices" and "--channels". 
+            The elements are read once, channels interleaved, as an image of slices*dimA rows of dimB*channels elements, 
+            so raw files and generators are read in bands on the pool like a 2D image. Every channel is then downsampled in the same pass.
+             
              @param 
-                    result - modeMap object with all the elements, mode and count data.
-                    index - index of the 2x2 block in the baseImage.
-                    threadNumber - thread reading a particular 2x2 block in the baseImage.
-
+                    options - settings from the command line
+                    pool - workers used for reading and downsampling
+                    input - the input container, which can't be used here
+                    dimA, dimB - rows and cols of every slice
              @return 
                     void           
             */
-            
-            
-            void addBlock(int threadNumber, int index, modeMap result) 
-            {
-               // std::cout << "I'm Inside add Block " << std::endl;
-                switch(threadNumber){
+template <typename Pixel, typename Count>
+void runVolume(const commandLineOptions & options, workStealingPool & pool, pyramidFile * input, int dimA, int dimB)
+{
+    if(input || !options.outputPath.empty() || options.stream || !options.tiles.empty() || options.level >= 0 || options.morton || options.fuseLevels > 0)
+        throw std::runtime_error("--slices and --channels only read raw files or generated images and print the levels");
+    if(options.slices < 0 || options.channels < 1) throw std::runtime_error("--slices and --channels have to be positive");
 
-                    case 1 :
-                        { 
-                        std::lock_guard<std::mutex> guard(mapMutexThread1);
-                        m_mapCollectThread1.insert(std::pair<int, modeMap>(index, result));
-                        break;
-                        }
-                    case 2 :
-                        {
-                        std::lock_guard<std::mutex> guard(mapMutexThread2);
-                        m_mapCollectThread2.insert(std::pair<int, modeMap>(index, result));
-                        break;
-                        }
-                
-                    case 3 : 
-                        {
-                        std::lock_guard<std::mutex> guard(mapMutexThread3);
-                        m_mapCollectThread3.insert(std::pair<int, modeMap>(index, result));
-                        break;
-                        }
-                    
+    edgePolicy policy = parseEdgePolicy(options.edge);
+    std::vector<std::string> reductions = parseReductions(options.reductions);
+    std::vector<double> weights;
+    for(const std::string & weight : splitList(options.weights)) weights.push_back(std::strtod(weight.c_str(), nullptr));
 
-                    case 4 :
-                        {
-                        std::lock_guard<std::mutex> guard(mapMutexThread4);
-                        m_mapCollectThread4.insert(std::pair<int, modeMap>(index, result));
-                        break;
-                        }	
-                    }	
-                return;
-            }
-            
-            
-              /**
+    int slices = std::max(1, options.slices);
+    int rows = slices * dimA, cols = dimB * options.channels;
+    std::unique_ptr< imageSource<Pixel> > source(makeImageSource<Pixel>(options, nullptr, rows, cols));
+
+    std::unique_ptr<Pixel[]> pixels(new Pixel[static_cast<size_t>(rows) * cols]);
+    readImageRows(*source, &pool, 0, rows, pixels.get());
+
+    std::vector<int> dims;
+    if(options.slices > 0) dims.push_back(slices);
+    dims.push_back(dimA);
+    dims.push_back(dimB);
+
+    ndArray<Pixel, Count> volume(pixels.get(), dims, options.channels, policy);
+    volume.setTopK(options.topK);
+    volume.setPool(&pool);
+
+    traceScope trace("output");
+    for(const std::string & reduction : reductions)
+    {
+        if(reductions.size() > 1) std::cout << "Reduction : " << reduction << std::endl;
+        outputReduction(volume, reduction, weights, nullptr);
+    }
+}
+
+/**
             
-            Recursive function to sub matrix into 2x2 blocks which are then used to compute downsampled images.            
+            Function to downsample one 2D image with elements of type Pixel counted in Count, as described by the command line options. 
              
              @param 
-                    rowStart, rowEnd - row positions of the elements in the baseImage 
-                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
-                    depth - Depth of the cube in the baseImage 
-                    threadNumber - thread reading a particular 2x2 block in the baseImage.
-
+                    options - settings from the command line
+                    pool - workers used for downsampling
+                    input - the input container, when the input is one
+                    dimA, dimB - dimensions of the image
              @return 
                     void           
             */
-            
-            void divideCube(int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber)
-            {
+template <typename Pixel, typename Count>
+void runImage(const commandLineOptions & options, workStealingPool & pool, pyramidFile * input, int dimA, int dimB)
+{
+    edgePolicy policy = parseEdgePolicy(options.edge);
+    std::vector<std::string> reductions = parseReductions(options.reductions);
+    std::vector<double> weights;
+    for(const std::string & weight : splitList(options.weights)) weights.push_back(std::strtod(weight.c_str(), nullptr));
 
-                if((rowEnd-rowStart) == 2 && (colEnd-colStart) == 2)
-                {	
-                    modeMap result = findMode(rowStart, rowEnd, colStart, colEnd, depth, threadNumber);
-                    int index = (rowEnd/2)*(m_dimB/2) + (colEnd/2);
-                    addBlock(threadNumber, index, result);
-                    return;
-                } 
+    std::unique_ptr<pyramidFile> output;
+    if(!options.outputPath.empty()) output.reset(new pyramidFile(options.outputPath, dimA, dimB, sizeof(Pixel), policy));
 
-                else if((rowEnd - rowStart) !=2)
-                {
-                    divideCube( rowStart, rowStart + (rowEnd-rowStart)/2, colStart, colEnd, depth, threadNumber);
+    std::unique_ptr< imageSource<Pixel> > source(makeImageSource<Pixel>(options, input, dimA, dimB));
 
+    if(options.stream)
+    {
+        if(reductions.size() != 1 || reductions[0] != "mode") throw std::runtime_error("--stream only writes the mode");
 
-                    divideCube( rowStart + (rowEnd-rowStart)/2, rowEnd, colStart, colEnd, depth, threadNumber);
-                
-                }
-                else if((colEnd-colStart) != 2) 
-                {       
-                          divideCube( rowStart, rowEnd, colStart, colStart + (colEnd - colStart)/2, depth, threadNumber);
-                                
-                          divideCube( rowStart, rowEnd, colStart+(colEnd - colStart)/2, colEnd, depth, threadNumber);
-                
-                }
+        std::unique_ptr< levelSink<Pixel> > sink;
+        if(output) sink.reset(new containerLevelSink<Pixel>(*output));
+        else sink.reset(new textLevelSink<Pixel>(options.prefix, pyramidLevelCount(dimA, dimB, policy)));
 
-                return;
+        stripDownsampler<Pixel, Count> downsampler(*source, *sink, pool, options.stripRows, policy, options.topK);
+        downsampler.run();
+        return;
+    }
+
+    //The image is read in place when the source already holds it, otherwise it is loaded into the output container or into memory on the pool.
+    //rand() values can only be generated serially, those are left to the twoDArray constructor.
+    //The loaded buffer is left uninitialized so its pages are first touched by the workers reading the bands, and a pinned pool 
+    //loads even an image it could read in place, so that every node reads its rows from local memory.
+    std::unique_ptr<Pixel[]> loaded;
+    const Pixel * pixels = source->data();
+
+    if(output)
+    {
+        readImageRows(*source, &pool, 0, dimA, output->getBaseImage<Pixel>());
+        pixels = output->getBaseImage<Pixel>();
+    }
+    else if(source->concurrentReads() && (!pixels || pool.isPinned()))
+    {
+        loaded.reset(new Pixel[static_cast<size_t>(dimA) * dimB]);
+        readImageRows(*source, &pool, 0, dimA, loaded.get());
+        pixels = loaded.get();
+    }
+
+    //Create an object, its levels are placed by the workers of a pinned pool
+    typename twoDArray<Pixel, Count>::arenaType arena(pool.isPinned() ? &pool : nullptr);
+    std::unique_ptr< twoDArray<Pixel, Count> > ImageData(pixels ? new twoDArray<Pixel, Count>(pixels, dimA, dimB, policy, &arena) : new twoDArray<Pixel, Count>(dimA, dimB, policy, &arena));
+    ImageData->setTopK(options.topK);
+    ImageData->setPool(&pool);
+    ImageData->setFusedLevels(options.fuseLevels);
+    if(options.morton) ImageData->useMortonLayout();
+
+    //Tiles are served on demand instead of building the pyramid
+    if(!options.tiles.empty())
+    {
+        if(reductions.size() != 1 || reductions[0] != "mode" || output) throw std::runtime_error("--tiles only prints the mode");
+
+        pyramidTileService<Pixel, Count> service(static_cast<size_t>(std::max(0, options.cacheMegabytes)) << 20, options.tileSize);
+        service.addImage(0, *ImageData);
+
+        for(const std::string & spec : splitList(options.tiles))
+        {
+            int level = 0, x = 0, y = 0;
+            char first = 0, second = 0;
+            std::istringstream address(spec);
+            if(!(address >> level >> first >> x >> second >> y) || first != ':' || second != ':') throw std::runtime_error("--tiles has to be a list of L:X:Y");
+
+            typename pyramidTileService<Pixel, Count>::tilePointer tile = service.readTile(0, level, x, y);
+            std::cout << "Tile " << level << " " << x << " " << y << " : " << std::endl;
+            for(int r = 0; r < tile->rows; ++r)
+            {
+                for(int c = 0; c < tile->cols; ++c) std::cout << static_cast<unsigned long>(tile->values[static_cast<size_t>(r) * tile->cols + c]) << " ";
+                std::cout << std::endl;
             }
+        }
+        return;
+    }
+
+    //A single level is computed on demand instead of building the pyramid
+    if(options.level >= 0)
+    {
+        if(reductions.size() != 1 || reductions[0] != "mode" || output) throw std::runtime_error("--level only prints the mode");
+        if(options.level >= ImageData->getLevelCount()) throw std::runtime_error("--level has to be below the number of levels");
+
+        int rows = ImageData->getLevelRows(options.level), cols = ImageData->getLevelCols(options.level);
+
+        std::vector<std::string> region = splitList(options.region);
+        int row = 0, col = 0;
+        if(!region.empty())
+        {
+            if(region.size() != 4) throw std::runtime_error("--region has to be ROW,COL,ROWS,COLS");
+            row = std::atoi(region[0].c_str());
+            col = std::atoi(region[1].c_str());
+            rows = std::atoi(region[2].c_str());
+            cols = std::atoi(region[3].c_str());
+        }
+
+        std::vector<Pixel> values;
+        ImageData->getRegion(options.level, row, row + rows, col, col + cols, values);
+        for(int r = 0; r < rows; ++r)
+        {
+            for(int c = 0; c < cols; ++c) std::cout << static_cast<unsigned long>(values[static_cast<size_t>(r) * cols + c]) << " ";
+            std::cout << std::endl;
+        }
+        return;
+    }
+
+    //Read every 2x2 block into its slot of the first level. 
+    startThreading(pool, *ImageData, 0, dimA, 0, dimB, ImageData->getDepth());
+
+    //Free the base image.
+    ImageData->mergeAllMaps();
+
+    //std::cout << "The number of smallest cubes is : " << ImageData->getGlobalMapSize()  << std::endl;
+    traceScope trace("output");
+    for(size_t i = 0; i < reductions.size(); ++i)
+    {
+        if(i == 0 || !output)
+        {
+            if(reductions.size() > 1 && !output) std::cout << "Reduction : " << reductions[i] << std::endl;
+            outputReduction(*ImageData, reductions[i], weights, output.get());
+            continue;
+        }
+
+        pyramidFile extra(options.outputPath + "." + reductions[i], dimA, dimB, sizeof(Pixel), policy);
+        std::copy(pixels, pixels + static_cast<size_t>(dimA) * dimB, extra.getBaseImage<Pixel>());
+        instrumentation::add(&threadCounters::bytesCopied, static_cast<uint64_t>(dimA) * dimB * sizeof(Pixel));
+        outputReduction(*ImageData, reductions[i], weights, &extra);
+    }
+}
+
+/**
             
-             /**
-            
-            Function to merge all m_mapCollectThread1(2,3,4) map objects and populate globalMap object.        
-            Memory is freed from all the m_mapCollectThread1(2,3,4)  objects. 
+            Function to downsample one image or volume with elements of type Pixel, as described by the command line options. 
+            The histograms count in unsigned int unless a cell of the pyramid counts 2^32 elements or more, 
+            as the top levels of the largest rasters do, in which case they count in uint64_t.
              
              @param 
-                    void  
+                    options - settings from the command line
+                    pool - workers used for downsampling
+                    input - the input container, when the input is one
+                    dimA, dimB - dimensions of the image, or of every slice of a volume
              @return 
                     void           
             */
-            
-            void mergeAllMaps()
-            {    
+template <typename Pixel>
+void runDownsample(const commandLineOptions & options, workStealingPool & pool, pyramidFile * input, int dimA, int dimB)
+{
+    bool volume = (options.slices != 0 || options.channels != 1);
+    bool wide = pyramidCellElements({std::max(1, options.slices), dimA, dimB}, parseEdgePolicy(options.edge)) > std::numeric_limits<unsigned int>::max();
 
+    if(volume && wide) runVolume<Pixel, uint64_t>(options, pool, input, dimA, dimB);
+    else if(volume) runVolume<Pixel, unsigned int>(options, pool, input, dimA, dimB);
+    else if(wide) runImage<Pixel, uint64_t>(options, pool, input, dimA, dimB);
+    else runImage<Pixel, unsigned int>(options, pool, input, dimA, dimB);
+}
 
-                m_globalMap.insert(m_mapCollectThread1.begin(), m_mapCollectThread1.end());
-                m_mapCollectThread1.clear();
-                
-                m_globalMap.insert(m_mapCollectThread2.begin(), m_mapCollectThread2.end());
-                m_mapCollectThread2.clear();
-                
-                m_globalMap.insert(m_mapCollectThread3.begin(), m_mapCollectThread3.end());
-                m_mapCollectThread3.clear();
-                
-                m_globalMap.insert(m_mapCollectThread4.begin(), m_mapCollectThread4.end());
-                m_mapCollectThread4.clear();
-                
-                //Free the memory allocated for the image since we now have all the data in globalMap
-                m_baseImage.resize(extents[0][0]);
-                
-                return;
-            }
-            
-            //Getter function to read globalMap size. 
-            size_t getGlobalMapSize()
-            {
-                return m_globalMap.size();
-            }
-            
-            //Getter function to read depth
-            int getDepth()
-            {
-                return m_depth;
-            }
-            
-            /**
+
+//Writes the instrumentation trace to path, when "--trace" asked for one. Throws std::runtime_error if the file can't be written.
+void writeTraceFile(const std::string & path)
+{
+    if(path.empty()) return;
+
+    std::ofstream file(path.c_str());
+    instrumentation::writeTrace(file);
+    if(!file) throw std::runtime_error("cannot write " + path);
+}
+
+/**
             
-            Function to print all downsampled versions of a 2D image. This function also calls the reduceGlobalMap() which groups 2x2 blocks from the base image.
-            It runs through a loop and print values from the globalMap. It also keeps track of rows and colums of the downsampled images
+            Function to fill an image with reproducible benchmark input. The values come from a std::mt19937 with a fixed seed, 
+            so every run and every machine gets the same image.
              
              @param 
-                    void  
+                    pixels - receives rows*cols elements in row-major order
+                    rows, cols - dimensions of the image
+                    domain - values are taken from 0 .. domain-1
+                    distribution - "uniform": every element is independent, 
+                                   "clustered": 16x16 tiles share a value, one element in four is independent noise,
+                                   "constant": every element is 0
              @return 
                     void           
             */
-            void printDownsampled()
+template <typename Pixel>
+void generateImage(std::vector<Pixel> & pixels, int rows, int cols, unsigned long domain, const std::string & distribution)
+{
+    std::mt19937 random(3);
+    pixels.resize(static_cast<size_t>(rows) * cols);
+
+    if(distribution == "uniform")
+    {
+        for(size_t i = 0; i < pixels.size(); ++i) pixels[i] = static_cast<Pixel>(random() % domain);
+    }
+    else if(distribution == "clustered")
+    {
+        int tileCols = (cols + 15) / 16;
+        std::vector<Pixel> tiles(static_cast<size_t>((rows + 15) / 16) * tileCols);
+        for(size_t t = 0; t < tiles.size(); ++t) tiles[t] = static_cast<Pixel>(random() % domain);
+
+        for(int r = 0; r < rows; ++r)
+        {
+            for(int c = 0; c < cols; ++c)
             {
-                
-                //Outerloop to print the number of downsampled images based on the value of minDim.
-                for(int k = m_minDim; k > 1; k /= 2)
-                {
-                    int j = 1;
-                    
-                    //Inner loop to print elements 
-                    for(auto i = m_globalMap.begin(); i != m_globalMap.end(); ++i, ++j)
-                    {
-                        
-                        std::cout << (i->second).getMode() << " " ;
-                        
-                        if (j%(m_downCols) == 0 ) 
-                            std::cout << std::endl;
-                    }
-                    
-                    std::cout << std::endl;
-                    
-                    //Reduce the globalMap size after every iteration. This increases the grouping size in the base image and forms new Map objects. 
-                    if(getGlobalMapSize() >1) reduceGlobalMap();
-                    
-                }
-                
-                 return;
+                unsigned long draw = random();
+                pixels[static_cast<size_t>(r) * cols + c] = (draw % 4 == 0) ? static_cast<Pixel>((draw / 4) % domain) : tiles[(r / 16) * tileCols + c / 16];
             }
+        }
+    }
+    else if(distribution == "constant")
+    {
+        std::fill(pixels.begin(), pixels.end(), Pixel(0));
+    }
+    else throw std::runtime_error("--distributions has to be a list of uniform, clustered and constant");
+}
+
+//Milliseconds since start
+double millisecondsSince(high_resolution_clock::time_point start)
+{
+    return duration<double, std::milli>(high_resolution_clock::now() - start).count();
+}
+
+/**
             
-            
-            /**
-            
-            Helper funtion for printDownsampled(). Everytime reduceGlobalMap() is called it groups 2x more elements in row and columns of the base image. 
-            Since we are keep track of element counts in individual modeMaps, we need not read the base Image everytime to produce a downsampled image. 
-             
-             
-             From the description of class twoDArray, this is a 1-downsampled 2x2 image where each element is a modeMap object having data about the different elements in the baseImage and their counts.
-             
-             01 02 | 03 04
-             05 06 | 07 08
-             -----------------
-             09 10 | 11 12
-             13 14 | 15 16
-             
-             After downsampling, the new set of modeMap objects look like this 
-             
-             01new | 02new
-             -----------------
-             03new | 04new
+            Function to time the downsampling of one generated image and print the result as a JSON object. 
+            Each phase is timed on its own: generation, setup of the twoDArray, startThreading, mergeAllMaps, every reduceGlobalMap 
+            and the output, which is writeDownsampled() into the --output container if there is one, printDownsampled() into memory otherwise. 
+            The throughput covers setup up to the last reduceGlobalMap, generation and output are left out.
              
-             where,
+             @param 
+                    options - settings from the command line
+                    pool - workers used for downsampling
+                    rows, cols, domain, distribution - the image, see generateImage()
+                    out - receives the JSON object
+             @return 
+                    void           
+            */
+template <typename Pixel>
+void benchmarkRun(const commandLineOptions & options, workStealingPool & pool, int rows, int cols, unsigned long domain, const std::string & distribution, std::ostream & out)
+{
+    edgePolicy policy = parseEdgePolicy(options.edge);
+    std::vector<Pixel> pixels;
 
-             01new = group ( 01, 02, 05, 06)
-             02new = group ( 03, 04, 07, 08)
-             03new = group ( 09, 10, 13, 14)
-             04new = group ( 11, 12, 15, 16)
-             
-             And the process continues until one we reach the minDim.
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    generateImage(pixels, rows, cols, domain, distribution);
+    double generation = millisecondsSince(start);
+
+    start = high_resolution_clock::now();
+    typename twoDArray<Pixel>::arenaType arena(pool.isPinned() ? &pool : nullptr);
+    twoDArray<Pixel> image(pixels.data(), rows, cols, policy, &arena);
+    image.setTopK(options.topK);
+    image.setPool(&pool);
+    image.setFusedLevels(options.fuseLevels);
+    if(options.morton) image.useMortonLayout();
+    double setup = millisecondsSince(start);
+
+    start = high_resolution_clock::now();
+    startThreading(pool, image, 0, rows, 0, cols, image.getDepth());
+    double threading = millisecondsSince(start);
+
+    start = high_resolution_clock::now();
+    image.mergeAllMaps();
+    double merging = millisecondsSince(start);
+
+    //Levels fused into the tiles were built by startThreading
+    std::vector<double> reduce;
+    while(image.getLevelsBuilt() < static_cast<size_t>(image.getLevelCount()))
+    {
+        start = high_resolution_clock::now();
+        image.reduceGlobalMap();
+        reduce.push_back(millisecondsSince(start));
+    }
+
+    double output;
+    if(!options.outputPath.empty())
+    {
+        pyramidFile file(options.outputPath, rows, cols, sizeof(Pixel), policy);
+        start = high_resolution_clock::now();
+        image.writeDownsampled(file);
+        output = millisecondsSince(start);
+    }
+    else
+    {
+        std::ostringstream text;
+        start = high_resolution_clock::now();
+        image.printDownsampled(text);
+        output = millisecondsSince(start);
+    }
+
+    double downsampling = setup + threading + merging;
+    for(size_t level = 0; level < reduce.size(); ++level) downsampling += reduce[level];
+
+    out << "{\"rows\": " << rows << ", \"cols\": " << cols << ", \"threads\": " << pool.getThreadCount() 
+        << ", \"domain\": " << domain << ", \"distribution\": \"" << distribution << "\", \"levels\": " << image.getLevelCount()
+        << ", \"phases_ms\": {\"generation\": " << generation << ", \"setup\": " << setup << ", \"startThreading\": " << threading 
+        << ", \"mergeAllMaps\": " << merging << ", \"reduceGlobalMap\": [";
+    for(size_t level = 0; level < reduce.size(); ++level) out << (level ? ", " : "") << reduce[level];
+    out << "], \"output\": " << output << "}, \"downsampling_ms\": " << downsampling 
+        << ", \"mpixels_per_s\": " << (downsampling > 0 ? static_cast<double>(rows) * cols / downsampling / 1000.0 : 0.0) << "}";
+}
+
+/**
+            
+            Function to time downsampleBatch() on options.batch copies of one generated image and print the result as a JSON object.
              
              @param 
-                    void  
+                    options - settings from the command line
+                    pool - workers used for downsampling
+                    rows, cols, domain, distribution - the image, see generateImage()
+                    out - receives the JSON object
              @return 
                     void           
             */
-            
-            void reduceGlobalMap()
-            {
-                int j =1;
-                map < int, modeMap > new_globalMap;
-                modeMap updatedCube;
-                for(auto i = m_globalMap.begin(); i != m_globalMap.end(); ++j)
-                {
-                    
-                    auto copy = i, k =i, l =i, m = i;
-                    advance(k,1);
-                    advance(l,m_downCols);
-                    advance(m,m_downCols+1);
-        
-                    //Add for modeMaps to form a new one for the downsampled image
-                    updatedCube = (i->second + k->second)+ (l->second + m->second) ;                  
-                    
-                    //Update the mode for the new modeMap
-                    updatedCube.calculateMode();
-                    
-                    //Advance the current iterator by 4 modeMaps since we are grouping only 4 modeMaps at any step in the process.
-                    advance(i,4);
-        
-                    // form a new globalMap 
-                    new_globalMap.insert(std::pair<int, modeMap>(j, updatedCube));        
-                    
-                }
-                
-                //Clear memory once downsampling is done and update member variables accordingly. 
-                m_globalMap.clear();
-                m_globalMap = new_globalMap;
-                m_downCols /= 2;
-                m_downRows /= 2;
-                m_minDim /= 2; 
-               
-               std::cout << "The number of cubes is : " << getGlobalMapSize()  << std::endl;               
-               
-               return;
-                
-            }
-};
+template <typename Pixel>
+void benchmarkBatch(const commandLineOptions & options, workStealingPool & pool, int rows, int cols, unsigned long domain, const std::string & distribution, std::ostream & out)
+{
+    edgePolicy policy = parseEdgePolicy(options.edge);
+    std::vector< std::vector<Pixel> > pixels(options.batch);
+    std::vector< batchImage<Pixel> > images(options.batch);
+    std::vector< pyramidModes<Pixel> > results;
+
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    for(int i = 0; i < options.batch; ++i)
+    {
+        generateImage(pixels[i], rows, cols, domain, distribution);
+        images[i].pixels = pixels[i].data();
+        images[i].rows = rows;
+        images[i].cols = cols;
+    }
+    double generation = millisecondsSince(start);
+
+    start = high_resolution_clock::now();
+    downsampleBatch(pool, images, results, policy, options.topK);
+    double downsampling = millisecondsSince(start);
+
+    out << "{\"rows\": " << rows << ", \"cols\": " << cols << ", \"threads\": " << pool.getThreadCount() 
+        << ", \"domain\": " << domain << ", \"distribution\": \"" << distribution << "\", \"batch\": " << options.batch
+        << ", \"phases_ms\": {\"generation\": " << generation << ", \"downsampleBatch\": " << downsampling << "}, \"downsampling_ms\": " << downsampling 
+        << ", \"mpixels_per_s\": " << (downsampling > 0 ? static_cast<double>(rows) * cols * options.batch / downsampling / 1000.0 : 0.0) << "}";
+}
 
 /**
             
-            Recursive function to split a 2D array into 4 symmetric blocks and have one thread working on each of them. 
-            Recursion bottoms out when max threads have been created or min block size of 2x2 is reached.
+            Function to run every combination of the benchmark lists in the command line options and print a JSON document 
+            with one entry per run. A pool is created for every thread count.
              
              @param 
-                    rowStart, rowEnd - row positions of the elements in the baseImage 
-                    colStart, colEnd - col psitiiop pf tje elemtnes in the baseImage.
-                    depth - Depth of the cube in the baseImage 
-                    threadNumber - thread reading a particular 2x2 block in the baseImage.  
-                    userImage - a twoDArray object whose downsampled versions we are interested in.
-                    totalThreads - totalThreads that have been created by this function
-                    
+                    options - settings from the command line
+                    out - receives the JSON document
              @return 
                     void           
             */
-            
-void  startThreading(twoDArray & userImage, int rowStart, int rowEnd, int colStart, int colEnd, int depth, int threadNumber = 1, int totalThreads = 1)
+template <typename Pixel>
+void runBenchmark(const commandLineOptions & options, std::ostream & out)
 {
+    std::vector<unsigned int> threadCounts;
+    for(const std::string & threads : splitList(options.threadCounts)) threadCounts.push_back(parseThreadCount(threads, "--threads-list has to be a list of thread counts, 0 for one per core"));
+    if(threadCounts.empty()) threadCounts.push_back(options.threads);
 
-	if(depth > 1 && (rowEnd-rowStart) > 2 && (colEnd-colStart) > 2 && totalThreads < MAX_THREADS)
-	{
- 
-		auto thread1 = std::thread(&startThreading, ref(userImage), rowStart, rowStart + (rowEnd - rowStart)/2, colStart, colStart + (colEnd - colStart)/2, depth-1, 1, totalThreads*4);
+    out << "{\"benchmark\": \"downsample\", \"bits\": " << 8 * sizeof(Pixel) << ", \"edge\": \"" << options.edge 
+        << "\", \"top_k\": " << options.topK << ", \"fuse_levels\": " << options.fuseLevels << ", \"morton\": " << (options.morton ? "true" : "false") 
+        << ", \"numa\": " << (options.numa ? "true" : "false") << ", \"repeat\": " << options.repeat << ", \"runs\": [";
+    bool first = true;
+    numaTopology topology;
 
-		auto thread2 = std::thread(&startThreading, ref(userImage), rowStart, rowStart + (rowEnd - rowStart)/2, colStart + (colEnd - colStart)/2, colEnd, depth-1, 2, totalThreads*4);
+    for(unsigned int threads : threadCounts)
+    {
+        workStealingPool pool(threads, options.numa ? &topology : nullptr);
 
-		auto thread3 = std::thread(&startThreading, ref(userImage), rowStart + (rowEnd - rowStart)/2, rowEnd, colStart, colStart + (colEnd - colStart)/2, depth-1, 3, totalThreads*4);
+        for(const std::string & dims : splitList(options.dims))
+        {
+            int rows = 0, cols = 0;
+            char separator = 0;
+            std::istringstream size(dims);
+            if(!(size >> rows >> separator >> cols) || separator != 'x' || rows < 1 || cols < 1)
+                throw std::runtime_error("--dims has to be a list of RxC");
 
-		auto thread4 = std::thread(&startThreading, ref(userImage), rowStart + (rowEnd - rowStart)/2, rowEnd, colStart + (colEnd - colStart)/2, colEnd, depth-1, 4, totalThreads*4);
+            for(const std::string & domainText : splitList(options.domains))
+            {
+                unsigned long domain = std::strtoul(domainText.c_str(), nullptr, 10);
+                if(domain < 1 || domain - 1 > std::numeric_limits<Pixel>::max())
+                    throw std::runtime_error("--domains has to be a list of value counts that fit in --bits");
 
-		thread1.join();
-        thread2.join();
-		thread3.join();
-		thread4.join();
-		
-	} 
-	
-	else
-	{
-		userImage.divideCube(rowStart, rowEnd, colStart, colEnd, depth, threadNumber);
-	}
-	return;	
+                for(const std::string & distribution : splitList(options.distributions))
+                {
+                    for(int run = 0; run < options.repeat; ++run)
+                    {
+                        out << (first ? "\n  " : ",\n  ");
+                        first = false;
+                        if(options.batch > 0) benchmarkBatch<Pixel>(options, pool, rows, cols, domain, distribution, out);
+                        else benchmarkRun<Pixel>(options, pool, rows, cols, domain, distribution, out);
+                        out.flush();
+                    }
+                }
+            }
+        }
+    }
+
+    out << "\n]}" << std::endl;
 }
 
 
 
-int main()
+int main(int argc, char * argv[])
 
 {
 
-// Timers to measure performance;  
-high_resolution_clock::time_point t1 = high_resolution_clock::now();   
+commandLineOptions options;
 
-//Set the seed for random number generation 
-srand(3);
+try
+{
+for(int arg = 1; arg < argc; ++arg)
+{
+    std::string option = argv[arg];
+
+    //The argument after an option that takes one
+    auto value = [&]() -> const char *
+    {
+        if(arg + 1 == argc) throw std::runtime_error(option + " needs a value");
+        return argv[++arg];
+    };
+
+    if(option == "--stream") options.stream = true;
+    else if(option == "--benchmark") options.benchmark = true;
+    else if(option == "--morton") options.morton = true;
+    else if(option == "--numa") options.numa = true;
+    else if(option == "--threads") options.threads = parseThreadCount(value());
+    else if(option == "--bits") options.bits = std::atoi(value());
+    else if(option == "--prefix") options.prefix = value();
+    else if(option == "--input") options.inputPath = value();
+    else if(option == "--output") options.outputPath = value();
+    else if(option == "--generator") options.generator = value();
+    else if(option == "--seed") options.seed = static_cast<unsigned int>(std::strtoul(value(), nullptr, 10));
+    else if(option == "--strip-rows") options.stripRows = std::atoi(value());
+    else if(option == "--edge") options.edge = value();
+    else if(option == "--dims") options.dims = value();
+    else if(option == "--threads-list") options.threadCounts = value();
+    else if(option == "--domains") options.domains = value();
+    else if(option == "--distributions") options.distributions = value();
+    else if(option == "--repeat") options.repeat = std::atoi(value());
+    else if(option == "--batch") options.batch = std::atoi(value());
+    else if(option == "--trace") options.tracePath = value();
+    else if(option == "--reduce") options.reductions = value();
+    else if(option == "--weights") options.weights = value();
+    else if(option == "--level") options.level = std::atoi(value());
+    else if(option == "--region") options.region = value();
+    else if(option == "--tiles") options.tiles = value();
+    else if(option == "--tile-size") options.tileSize = std::atoi(value());
+    else if(option == "--cache-mb") options.cacheMegabytes = std::atoi(value());
+    else if(option == "--slices") options.slices = std::atoi(value());
+    else if(option == "--channels") options.channels = std::atoi(value());
+    else if(option == "--fuse-levels") options.fuseLevels = std::atoi(value());
+    else if(option == "--top-k") options.topK = static_cast<size_t>(std::max(0, std::atoi(value())));
+    else throw std::runtime_error("unknown option " + option);
+}
+}
+catch(const std::exception & error)
+{
+    std::cerr << "Error : " << error.what() << std::endl;
+    return 1;
+}
+
+instrumentation::enable(!options.tracePath.empty());
 
+if(options.benchmark)
+{
+    try
+    {
+        switch(options.bits)
+        {
+            case 8 : runBenchmark<uint8_t>(options, std::cout); break;
+            case 16 : runBenchmark<uint16_t>(options, std::cout); break;
+            case 32 : runBenchmark<uint32_t>(options, std::cout); break;
+            default : throw std::runtime_error("--bits has to be 8, 16 or 32");
+        }
+        writeTraceFile(options.tracePath);
+    }
+    catch(const std::exception & error)
+    {
+        std::cerr << "Error : " << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
 
-int dimA, dimB ;
+numaTopology topology;
+std::unique_ptr<workStealingPool> pool(new workStealingPool(options.threads, options.numa ? &topology : nullptr));
 
+// Timers to measure performance, started once the dimensions have been read  
+high_resolution_clock::time_point t1;
 
-std::cout << "Enter the number of rows (in powers of 2) : " << std::endl;
-std::cin >> dimA;
+//Set the seed for random number generation 
+srand(options.seed);
 
-std::cout << "Enter the number of cols (in powers of 2) : "  << std::endl;
-std::cin >> dimB;
+try
+{
+    std::unique_ptr<pyramidFile> input;
+    int dimA, dimB, bits = options.bits;
 
-//Create an object
-twoDArray ImageData(dimA,dimB);
+    if(!options.inputPath.empty() && pyramidFile::isPyramidFile(options.inputPath))
+    {
+        input.reset(new pyramidFile(options.inputPath));
+        dimA = input->getRows();
+        dimB = input->getCols();
+        bits = 8 * input->getElementSize();
+    }
+    else
+    {
+        std::cout << "Enter the number of rows : " << std::endl;
+        if(!(std::cin >> dimA)) throw std::runtime_error("the number of rows has to be an integer");
 
-//Start populating the m_mapCollectThread1(2,3,4)  objects. 
-startThreading(ImageData, 0, dimA, 0, dimB, ImageData.getDepth());
+        std::cout << "Enter the number of cols : "  << std::endl;
+        if(!(std::cin >> dimB)) throw std::runtime_error("the number of cols has to be an integer");
+    }
 
-//Merge all m_mapCollectThread1(2,3,4)  objects together.
-ImageData.mergeAllMaps();
+    checkedDim(dimA);
+    checkedDim(dimB);
 
+    t1 = high_resolution_clock::now();
 
-//std::cout << "The number of smallest cubes is : " << ImageData.getGlobalMapSize()  << std::endl;
-ImageData.printDownsampled();
+    switch(bits)
+    {
+        case 8 : runDownsample<uint8_t>(options, *pool, input.get(), dimA, dimB); break;
+        case 16 : runDownsample<uint16_t>(options, *pool, input.get(), dimA, dimB); break;
+        case 32 : runDownsample<uint32_t>(options, *pool, input.get(), dimA, dimB); break;
+        default : throw std::runtime_error("--bits has to be 8, 16 or 32");
+    }
+}
+catch(const std::exception & error)
+{
+    std::cerr << "Error : " << error.what() << std::endl;
+    return 1;
+}
 
 high_resolution_clock::time_point t2 = high_resolution_clock::now();
 auto duration = duration_cast<milliseconds>( t2 - t1 ).count();
 std::cout << "The duration is : " << duration << " milli seconds " << std::endl;
 
-return 0;
+//The workers are stopped first so that nothing records while the trace is written
+pool.reset();
 
+try
+{
+    writeTraceFile(options.tracePath);
+}
+catch(const std::exception & error)
+{
+    std::cerr << "Error : " << error.what() << std::endl;
+    return 1;
 }
 
+return 0;
+
+}